@@ -0,0 +1,346 @@
+/*
+ * Offline batch processing of video files
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <opencv2/highgui/highgui_c.h>
+
+#include "batch.h"
+#include "stats.h"
+
+/* Segments processed ahead of the merge, per worker */
+#define BATCH_AHEAD	4
+
+struct batch_result {
+	uint64_t	timestamp;
+	int		num_hands;
+	struct hand_result hands[MAX_HANDS];
+};
+
+/*
+ * A run of frames of one file, decoded and detected independently of
+ * the others, with a detector of its own. Tracking state restarts at
+ * each segment, so its first frames are full scans.
+ */
+struct segment {
+	int		file;
+	unsigned long	start;		/* First frame */
+	unsigned long	count;		/* Zero up to the end of the file */
+	double		fps;
+
+	struct batch_result *results;
+	unsigned long	num_results;
+	unsigned long	size;
+
+	int		done;
+	int		error;
+};
+
+/*
+ * Workers take segments in order, and the calling thread writes out the
+ * results of each segment once all the previous ones are out, so the
+ * output of every file is in frame and timestamp order. Workers stay at
+ * most BATCH_AHEAD segments each ahead of the merge, which bounds the
+ * results held in memory.
+ */
+struct batch {
+	const struct batch_config *conf;
+	char		**files;
+
+	struct segment	*segments;
+	int		num_segments;
+	int		next;		/* First segment not taken */
+	int		merged;		/* Segments written out */
+	int		window;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	work_cond;	/* Merge progressed */
+	pthread_cond_t	done_cond;	/* A segment completed */
+};
+
+static int add_result(struct segment *seg, uint64_t timestamp,
+		      const struct hand_detector *det)
+{
+	struct batch_result *results, *r;
+	unsigned long size;
+	int i;
+
+	if (seg->num_results == seg->size) {
+		size = seg->size ? 2 * seg->size : BATCH_SEGMENT;
+		results = realloc(seg->results, size * sizeof(*results));
+		if (!results)
+			return -1;
+		seg->results = results;
+		seg->size = size;
+	}
+
+	/* The first slot is kept even without a hand, as live output does */
+	r = &seg->results[seg->num_results++];
+	r->timestamp = timestamp;
+	r->num_hands = MAX(hand_detector_num_hands(det), 1);
+	for (i = 0; i < r->num_hands; i++)
+		r->hands[i] = *hand_detector_result(det, i);
+	return 0;
+}
+
+/* Media time of a frame, in microseconds from the start of the file */
+static uint64_t frame_time(const struct segment *seg, CvCapture *capture,
+			   unsigned long frame)
+{
+	if (seg->fps > 0)
+		return frame * 1e6 / seg->fps;
+
+	return cvGetCaptureProperty(capture, CV_CAP_PROP_POS_MSEC) * 1000;
+}
+
+static void run_segment(struct batch *b, struct segment *seg)
+{
+	struct hand_detector *det = NULL;
+	struct hand_frame frame;
+	CvCapture *capture;
+	IplImage *image;
+	unsigned long n;
+
+	capture = cvCaptureFromFile(b->files[seg->file]);
+	if (!capture) {
+		seg->error = 1;
+		return;
+	}
+
+	/* The decoder starts from the keyframe before the first frame */
+	if (seg->start && !cvSetCaptureProperty(capture, CV_CAP_PROP_POS_FRAMES,
+						seg->start)) {
+		seg->error = 1;
+		goto out;
+	}
+
+	for (n = 0; !seg->count || n < seg->count; n++) {
+		if (*b->conf->stop)
+			break;
+
+		image = cvQueryFrame(capture);
+		if (!image)
+			break;
+
+		if (!det && hand_detector_create(&det, &b->conf->detector,
+						 image->width,
+						 image->height) < 0) {
+			seg->error = 1;
+			break;
+		}
+
+		frame.data = (unsigned char *)image->imageData;
+		frame.width = image->width;
+		frame.height = image->height;
+		frame.stride = image->widthStep;
+
+		STATS_TIME(STAGE_FRAME, hand_detector_process(det, &frame));
+		if (add_result(seg, frame_time(seg, capture, seg->start + n),
+			       det) < 0) {
+			seg->error = 1;
+			break;
+		}
+	}
+
+	hand_detector_destroy(det);
+out:
+	cvReleaseCapture(&capture);
+}
+
+static void *batch_worker(void *arg)
+{
+	struct batch *b = arg;
+	struct segment *seg;
+
+	pthread_mutex_lock(&b->lock);
+
+	for (;;) {
+		while (b->next < b->num_segments &&
+		       b->next >= b->merged + b->window)
+			pthread_cond_wait(&b->work_cond, &b->lock);
+		if (b->next == b->num_segments)
+			break;
+
+		seg = &b->segments[b->next++];
+		pthread_mutex_unlock(&b->lock);
+
+		run_segment(b, seg);
+
+		pthread_mutex_lock(&b->lock);
+		seg->done = 1;
+		pthread_cond_broadcast(&b->done_cond);
+	}
+
+	pthread_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+/*
+ * Cut each file into segments of segment_frames frames. Files that do
+ * not report their length are a single segment, and the last segment
+ * always runs to the end, as frame counts are only estimates for some
+ * containers. Returns the number of files that could not be opened.
+ */
+static int split_files(struct batch *b, int num_files)
+{
+	unsigned long total, start;
+	CvCapture *capture;
+	double fps;
+	int i, n = 0, size = 0, missing = 0;
+	struct segment *segments;
+
+	for (i = 0; i < num_files; i++) {
+		capture = cvCaptureFromFile(b->files[i]);
+		if (!capture) {
+			fprintf(stderr, "Error opening %s\n", b->files[i]);
+			missing++;
+			continue;
+		}
+		total = MAX(cvGetCaptureProperty(capture,
+						 CV_CAP_PROP_FRAME_COUNT), 0);
+		fps = cvGetCaptureProperty(capture, CV_CAP_PROP_FPS);
+		cvReleaseCapture(&capture);
+
+		for (start = 0; !start || start < total;
+		     start += b->conf->segment_frames) {
+			if (n == size) {
+				size = size ? 2 * size : 64;
+				segments = realloc(b->segments,
+						   size * sizeof(*segments));
+				if (!segments)
+					return -1;
+				b->segments = segments;
+			}
+
+			b->segments[n] = (struct segment) {
+				.file	= i,
+				.start	= start,
+				.fps	= fps,
+			};
+			if (start + b->conf->segment_frames < total)
+				b->segments[n].count = b->conf->segment_frames;
+			n++;
+
+			if (!total)
+				break;
+		}
+	}
+
+	b->num_segments = n;
+	return missing;
+}
+
+/*
+ * Detect on all the frames of the files, on all cores, and write the
+ * results to the sink, if any. Each file is a stream, whose frames are
+ * numbered from the start of the file and timestamped with their media
+ * time. Returns -1 if any file could not be processed completely.
+ */
+int batch_run(const struct batch_config *conf, char **files, int num_files,
+	      struct sink *sink)
+{
+	struct batch b = { .conf = conf, .files = files };
+	unsigned long j, frames = 0;
+	pthread_t *threads;
+	struct segment *seg;
+	int i, k, num_workers, ret;
+	int64_t start;
+	double secs;
+
+	ret = split_files(&b, num_files);
+	if (ret < 0) {
+		free(b.segments);
+		return -1;
+	}
+	ret = ret ? -1 : 0;
+
+	num_workers = conf->num_workers;
+	if (!num_workers)
+		num_workers = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	b.window = BATCH_AHEAD * num_workers;
+
+	threads = calloc(num_workers, sizeof(*threads));
+	if (!threads) {
+		free(b.segments);
+		return -1;
+	}
+
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.work_cond, NULL);
+	pthread_cond_init(&b.done_cond, NULL);
+
+	start = cvGetTickCount();
+
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&threads[i], NULL, batch_worker, &b)) {
+			num_workers = i;
+			ret = -1;
+			break;
+		}
+	}
+
+	for (i = 0; num_workers && i < b.num_segments; i++) {
+		seg = &b.segments[i];
+
+		pthread_mutex_lock(&b.lock);
+		while (!seg->done)
+			pthread_cond_wait(&b.done_cond, &b.lock);
+		pthread_mutex_unlock(&b.lock);
+
+		if (seg->error) {
+			fprintf(stderr, "Error processing %s from frame %lu\n",
+				files[seg->file], seg->start + seg->num_results);
+			ret = -1;
+		}
+
+		for (j = 0; sink && j < seg->num_results; j++)
+			for (k = 0; k < seg->results[j].num_hands; k++)
+				sink_write(sink, seg->file, seg->start + j,
+					   seg->results[j].timestamp, k,
+					   &seg->results[j].hands[k]);
+		frames += seg->num_results;
+
+		free(seg->results);
+		seg->results = NULL;
+
+		pthread_mutex_lock(&b.lock);
+		b.merged = i + 1;
+		pthread_cond_broadcast(&b.work_cond);
+		pthread_mutex_unlock(&b.lock);
+	}
+
+	for (i = 0; i < num_workers; i++)
+		pthread_join(threads[i], NULL);
+
+	secs = (cvGetTickCount() - start) / (cvGetTickFrequency() * 1e6);
+	fprintf(stderr, "batch: %d files, %d segments, %lu frames in %.2f s, "
+		"%.1f fps\n", num_files, b.num_segments, frames, secs,
+		secs > 0 ? frames / secs : 0.0);
+
+	pthread_cond_destroy(&b.done_cond);
+	pthread_cond_destroy(&b.work_cond);
+	pthread_mutex_destroy(&b.lock);
+	free(threads);
+	for (i = 0; i < b.num_segments; i++)
+		free(b.segments[i].results);
+	free(b.segments);
+
+	return ret;
+}
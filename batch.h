@@ -0,0 +1,39 @@
+/*
+ * Offline batch processing of video files
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <signal.h>
+
+#include "detector.h"
+#include "sink.h"
+
+/* Default length of a segment, in frames */
+#define BATCH_SEGMENT	500
+
+struct batch_config {
+	struct hand_config detector;
+	int		num_workers;	/* Zero for one per core */
+	int		segment_frames;
+	volatile sig_atomic_t *stop;	/* Set to stop early */
+};
+
+int batch_run(const struct batch_config *conf, char **files, int num_files,
+	      struct sink *sink);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * Online skin model calibration
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "calib.h"
+
+#define CALIB_POLL_US	20000
+
+/* Publish a model every CALIB_BATCHES batches, with enough samples */
+#define CALIB_BATCHES		8
+#define CALIB_MIN_SAMPLES	2000
+
+/* Weight kept by older samples at each new batch */
+#define CALIB_DECAY		0.95f
+
+/*
+ * Bounds are the CALIB_LOW and CALIB_HIGH fractions of the samples,
+ * widened by a margin on each channel and limited to a range that
+ * keeps the model plausible for skin.
+ */
+#define CALIB_LOW		0.02f
+#define CALIB_HIGH		0.98f
+#define CALIB_MARGIN		cvScalar(3, 12, 12, 0)
+#define CALIB_LIMIT_MIN		cvScalar(0, 20, 40, 0)
+#define CALIB_LIMIT_MAX		cvScalar(40, 255, 255, 255)
+
+/* Same conversion as cvCvtColor(CV_BGR2HSV), with hue in [-90, 90) */
+static void bgr_to_hsv(const uchar *p, int *h, int *s, int *v)
+{
+	int b = p[0], g = p[1], r = p[2];
+	int min = MIN(MIN(b, g), r);
+	float hue;
+	int d;
+
+	*v = MAX(MAX(b, g), r);
+	d = *v - min;
+	*s = *v ? cvRound(255.0 * d / *v) : 0;
+
+	if (!d)
+		hue = 0;
+	else if (*v == r)
+		hue = 30.0f * (g - b) / d;
+	else if (*v == g)
+		hue = 60 + 30.0f * (b - r) / d;
+	else
+		hue = 120 + 30.0f * (r - g) / d;
+
+	*h = cvRound(hue);
+	if (*h >= 90)
+		*h -= 180;
+}
+
+static void add_samples(struct calib *calib)
+{
+	int i, h, s, v;
+
+	for (i = 0; i < 180; i++)
+		calib->hue[i] *= CALIB_DECAY;
+	for (i = 0; i < 256; i++) {
+		calib->sat[i] *= CALIB_DECAY;
+		calib->val[i] *= CALIB_DECAY;
+	}
+	calib->total *= CALIB_DECAY;
+
+	for (i = 0; i < calib->num_samples; i++) {
+		bgr_to_hsv(calib->samples[i], &h, &s, &v);
+		calib->hue[h + 90]++;
+		calib->sat[s]++;
+		calib->val[v]++;
+	}
+	calib->total += calib->num_samples;
+}
+
+/* Bin at which the cumulated weight reaches a fraction of the total */
+static int percentile(const float *hist, int n, float total, float frac)
+{
+	float sum = 0;
+	int i;
+
+	for (i = 0; i < n - 1; i++) {
+		sum += hist[i];
+		if (sum >= total * frac)
+			break;
+	}
+
+	return i;
+}
+
+static double clamp(double x, double lo, double hi)
+{
+	return x < lo ? lo : x > hi ? hi : x;
+}
+
+static void publish(struct calib *calib)
+{
+	CvScalar lower, upper, margin = CALIB_MARGIN;
+	CvScalar lo = CALIB_LIMIT_MIN, hi = CALIB_LIMIT_MAX;
+	struct skin_model *cur, *model;
+	const float *hist[3] = { calib->hue, calib->sat, calib->val };
+	const int bins[3] = { 180, 256, 256 }, offset[3] = { -90, 0, 0 };
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		lower.val[i] = percentile(hist[i], bins[i], calib->total,
+					  CALIB_LOW) + offset[i];
+		upper.val[i] = percentile(hist[i], bins[i], calib->total,
+					  CALIB_HIGH) + offset[i];
+		lower.val[i] = clamp(lower.val[i] - margin.val[i],
+				     lo.val[i], hi.val[i]);
+		upper.val[i] = clamp(upper.val[i] + margin.val[i],
+				     lo.val[i], hi.val[i]);
+	}
+	lower.val[3] = 0;
+	upper.val[3] = 255;
+
+	cur = atomic_load(&calib->current);
+	for (i = 0; i < 3; i++) {
+		model = &calib->models[i];
+		if (model != cur && model != atomic_load(&calib->hazard))
+			break;
+	}
+
+	/* Ranges that do not map to contiguous tables are not published */
+	if (skin_hsv_init(&model->hsv, lower, upper) < 0)
+		return;
+	model->type = cur->type;
+	if (model->type == SKIN_MODEL_LUT)
+		skin_lut_from_hsv(&model->lut, &model->hsv);
+
+	atomic_store(&calib->current, model);
+	atomic_fetch_add(&calib->updates, 1);
+}
+
+static void *calib_thread(void *arg)
+{
+	struct calib *calib = arg;
+	struct sched_param param = { .sched_priority = 0 };
+
+	/* Only runs on otherwise idle cores */
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	while (!atomic_load(&calib->stop)) {
+		if (!atomic_load_explicit(&calib->ready,
+					  memory_order_acquire)) {
+			usleep(CALIB_POLL_US);
+			continue;
+		}
+
+		add_samples(calib);
+		atomic_store_explicit(&calib->ready, 0, memory_order_release);
+
+		if (++calib->batches % CALIB_BATCHES == 0 &&
+		    calib->total >= CALIB_MIN_SAMPLES)
+			publish(calib);
+	}
+
+	return NULL;
+}
+
+int calib_start(struct calib *calib, const struct skin_model *initial)
+{
+	memset(calib, 0, sizeof(*calib));
+
+	calib->models[0] = *initial;
+	atomic_init(&calib->current, &calib->models[0]);
+	atomic_init(&calib->hazard, &calib->models[0]);
+	atomic_init(&calib->ready, 0);
+	atomic_init(&calib->stop, 0);
+	atomic_init(&calib->updates, 0);
+
+	if (pthread_create(&calib->thread, NULL, calib_thread, calib))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Take the current model for a frame. It is not rewritten until the
+ * next call, as the thread sees it in hazard before it could reuse it.
+ */
+const struct skin_model *calib_acquire(struct calib *calib)
+{
+	struct skin_model *model;
+
+	do {
+		model = atomic_load(&calib->current);
+		atomic_store(&calib->hazard, model);
+	} while (model != atomic_load(&calib->current));
+
+	return model;
+}
+
+/*
+ * Copy pixels from the inner part of the hand circle, where there is
+ * the least background, if the thread is done with the last batch.
+ */
+void calib_sample(struct calib *calib, const IplImage *image,
+		  CvPoint center, int radius)
+{
+	int r = radius * 3 / 4, step, x, y, n = 0;
+	const uchar *row;
+
+	if (r < 2 || atomic_load_explicit(&calib->ready, memory_order_acquire))
+		return;
+
+	step = MAX(2 * r / CALIB_GRID, 1);
+
+	for (y = -r; y <= r && n < CALIB_SAMPLES; y += step) {
+		if (center.y + y < 0 || center.y + y >= image->height)
+			continue;
+		row = (uchar *)image->imageData +
+			(center.y + y) * image->widthStep;
+
+		for (x = -r; x <= r && n < CALIB_SAMPLES; x += step) {
+			if (x * x + y * y > r * r || center.x + x < 0 ||
+			    center.x + x >= image->width)
+				continue;
+			memcpy(calib->samples[n++], row + 3 * (center.x + x),
+			       3);
+		}
+	}
+
+	calib->num_samples = n;
+	atomic_store_explicit(&calib->ready, 1, memory_order_release);
+}
+
+void calib_stop(struct calib *calib)
+{
+	atomic_store(&calib->stop, 1);
+	pthread_join(calib->thread, NULL);
+}
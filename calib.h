@@ -0,0 +1,73 @@
+/*
+ * Online skin model calibration
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef CALIB_H
+#define CALIB_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <opencv2/core/core_c.h>
+
+#include "skin.h"
+
+/* Pixels taken from a detected hand, on a grid over its palm */
+#define CALIB_GRID	32
+#define CALIB_SAMPLES	(CALIB_GRID * CALIB_GRID)
+
+/* Frames between two samples */
+#define CALIB_INTERVAL	10
+
+/*
+ * The detector hands pixels from the palm of detected hands to a
+ * background thread, which keeps decaying HSV histograms of them and
+ * periodically publishes a skin model from their percentiles.
+ *
+ * Models are published by swapping the current pointer. The detector
+ * takes the model once per frame with calib_acquire(), announcing it in
+ * hazard, and the thread never rewrites the current model or the one
+ * announced: with three models there is always another one to write.
+ */
+struct calib {
+	struct skin_model models[3];
+	_Atomic(struct skin_model *) current;
+	_Atomic(struct skin_model *) hazard;	/* Model used by the detector */
+
+	/* Batch of samples, owned by the thread while ready is set */
+	uchar		samples[CALIB_SAMPLES][3];
+	int		num_samples;
+	atomic_int	ready;
+
+	/* Only used by the thread */
+	float		hue[180];	/* Indexed by signed hue + 90 */
+	float		sat[256];
+	float		val[256];
+	float		total;
+	int		batches;
+
+	pthread_t	thread;
+	atomic_int	stop;
+	atomic_ulong	updates;	/* Models published */
+};
+
+int calib_start(struct calib *calib, const struct skin_model *initial);
+const struct skin_model *calib_acquire(struct calib *calib);
+void calib_sample(struct calib *calib, const IplImage *image,
+		  CvPoint center, int radius);
+void calib_stop(struct calib *calib);
+
+#endif
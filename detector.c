@@ -0,0 +1,1549 @@
+/*
+ * Hand detector library
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#if defined(CHECK_SKIN_THRESHOLD)
+#include <stdio.h>	/* Only the debug check prints */
+#endif
+
+#include <opencv2/imgproc/imgproc_c.h>
+
+#include "detector.h"
+#include "calib.h"
+#include "geom.h"
+#include "gpu.h"
+#include "mask.h"
+#include "stats.h"
+#include "tasks.h"
+#include "tracker.h"
+
+/*
+ * All sequence storages are cleared at the end of every frame, so their
+ * size only depends on the content of a single frame. If a pathological
+ * frame makes a storage grow beyond the high-water mark, it is released
+ * and created again so that the memory is returned to the system.
+ */
+#define STORAGE_BLOCK_SIZE	(64 * 1024)
+#define STORAGE_HIGH_WATER	(1024 * 1024)
+
+/*
+ * Once storages have grown to fit the content of a scene, frames must not
+ * allocate any more memory. Build with -DDEBUG_ALLOCS to assert that
+ * after ALLOC_WARMUP frames.
+ */
+#define ALLOC_WARMUP		100
+
+/*
+ * In tracking mode only a window around the hand found in the previous
+ * frame is processed. The window is the bounding box of the last hand
+ * contour, grown by ROI_MARGIN percent of its size on each side plus
+ * ROI_BORDER pixels to cover the support of the filters.
+ */
+#define ROI_MARGIN		50
+#define ROI_BORDER		16
+
+/*
+ * In contour tracking mode the hand border is followed from the start
+ * point of the previous frame's border, looked for within TRACK_BAND
+ * pixels of detection resolution. A full contour search is made when
+ * the area changes by more than TRACK_AREA_CHANGE percent, which means
+ * that another blob was followed or that the hand merged with one.
+ */
+#define TRACK_BAND		8
+#define TRACK_AREA_CHANGE	25
+
+/*
+ * Contours other than the largest are only taken as hands when their
+ * area is at least HAND_AREA_RATIO percent of the largest one, so that
+ * small blobs never go through hull and finger search.
+ */
+#define HAND_AREA_RATIO		20
+
+/*
+ * A hand is matched with a tracker whose center is predicted within
+ * TRACK_GATE times its radius, otherwise the tracker starts over.
+ */
+#define TRACK_GATE		2
+
+/*
+ * Fingertips are peaks of the distance to the hand center along the
+ * contour, farther than FINGER_MIN_DIST percent of the hand radius and
+ * at least FINGER_MIN_GAP percent of it apart. Peaks within FINGER_EDGE
+ * pixels of the bottom of the frame are where the arm leaves it.
+ */
+#define FINGER_MIN_DIST		150
+#define FINGER_MIN_GAP		40
+#define FINGER_EDGE		10
+
+/*
+ * With a detection scale greater than 1, segmentation and contour search
+ * run on a frame downsampled by that factor, with proportionally smaller
+ * kernels. Fingertips are then moved to the farthest skin pixel from the
+ * hand center within REFINE_RADIUS downsampled pixels of their position.
+ */
+#define REFINE_RADIUS		2
+
+/*
+ * With several segmentation threads, the window is split in as many
+ * horizontal tiles, each overlapping its neighbours by the support of
+ * the filter chain. Windows are split in fewer tiles so that each has
+ * at least TILE_MIN_ROWS rows, below which the overlap costs more than
+ * the parallelism saves.
+ */
+#define TILE_MIN_ROWS		32
+
+/*
+ * Change detection compares one grey sample every CHANGE_STEP pixels in
+ * both directions with the frame of the last detection. A frame is left
+ * unprocessed when less than CHANGE_SAMPLES per thousand samples moved
+ * by more than the sensitivity level (CHANGE_LEVEL by default).
+ */
+#define CHANGE_STEP		8
+#define CHANGE_SAMPLES		2
+
+/*
+ * Images one pass of the segmentation chain works in, with their ROI
+ * set on the window it covers: the whole window, or a tile of it
+ */
+struct seg_buffers {
+	IplImage	*src;		/* Input frame */
+	IplImage	*small;		/* Downsampled input, if scaled */
+	IplImage	*temp3;		/* Denoised input, HSV model only */
+	IplImage	*temp1;		/* Scratch for CHECK_SKIN_THRESHOLD */
+	IplImage	*thr;		/* Thresholded input */
+	struct bitmask	*mask;		/* Output */
+};
+
+/* Private images of a segmentation tile, sized for its largest window */
+struct seg_tile {
+	struct seg_buffers buf;		/* src is a header over the frame */
+	struct bitmask	mask;
+};
+
+struct hand_detector {
+	IplImage	*image;		/* Header over the caller's frame */
+	IplImage	*thr_image;	/* After filtering and thresholding */
+	IplImage	*temp_image1;	/* Temporary image (1 channel) */
+	IplImage	*temp_image3;	/* Temporary image (3 channels) */
+	IplImage	*small_image;	/* Downsampled input image */
+	IplImage	*refine_image;	/* Mask around a fingertip */
+
+	/* Hands of the frame, largest first, as one array per field */
+	int		max_hands;	/* Slots in use, up to MAX_HANDS */
+	int		num_hands;
+	CvSeq		*contour[MAX_HANDS];	/* Hand contours */
+	CvSeq		*hull[MAX_HANDS];	/* Hand convex hulls */
+	struct hand_result hand[MAX_HANDS];	/* Detection output */
+
+	CvMemStorage	*hull_st;
+	CvMemStorage	*contour_st;
+	CvMemStorage	*temp_st;
+	CvMemStorage	*defects_st;
+	int		*finger_buf;	/* Scratch of find_fingers() */
+	int		finger_size;	/* Its length, the largest yet */
+
+	struct bitmask	mask;		/* Packed mask for morph operations */
+	struct mask_labels labels;	/* Its connected components */
+	int		morph_radius;	/* Of the square opening kernel */
+	int		scale;		/* Detection runs at 1/scale size */
+	int		smooth_size;	/* Aperture of the smoothing filters */
+	enum denoise_quality denoise;
+	CvRect		work_roi;	/* roi in downsampled coordinates */
+	struct skin_model skin;		/* Skin color classifier */
+	const struct skin_model *model;	/* Classifier for this frame */
+	int		calibrate;	/* Refine the model from hands */
+	struct calib	calib;
+	int		keep_mask;	/* Unpack the mask into thr_image */
+	struct gpu	*gpu;		/* OpenCL backend, if in use */
+
+	int		num_tiles;	/* One per segmentation thread */
+	int		num_tiles_used;	/* Splitting the current window */
+	struct seg_tile	*tiles;
+	struct task_pool tile_pool;
+
+	size_t		storage_peak;	/* Max bytes used by a single frame */
+	size_t		storage_size;	/* Bytes owned by storages */
+	unsigned long	alloc_frames;	/* Frames that had to allocate */
+
+	int		roi_rescan;	/* Full scan period, 0 disables ROI */
+	int		roi_frames;	/* Frames since last full scan */
+	int		roi_valid;	/* hand_rect is usable for tracking */
+	CvRect		roi;		/* Window processed in this frame */
+	int		num_rects;
+	CvRect		hand_rect[MAX_HANDS]; /* Boxes of last hand contours */
+	CvPoint		rect_center[MAX_HANDS]; /* Hand centers then */
+	int		rect_tracker[MAX_HANDS]; /* Tracker of each, or -1 */
+
+	int		track_rescan;	/* Full contour search period */
+	int		track_frames;	/* Frames since last full search */
+	int		track_valid;	/* track_seed is usable */
+	CvPoint		track_seed;	/* Start of last hand border */
+	geom_area_t	track_area;	/* Area enclosed by that border */
+
+	int		change_refresh;	/* Max frames between detections */
+	int		change_level;	/* Grey level change that counts */
+	int		change_frames;	/* Frames since last detection */
+	uchar		*thumb;		/* Samples of last detected frame */
+	uchar		*thumb_next;	/* Samples of current frame */
+	int		thumb_valid;
+	unsigned long	idle_frames;	/* Frames not processed */
+
+	int		filter;		/* Smooth results over time */
+	int		detect_interval; /* Frames between detections */
+	int		detect_frames;	/* Frames since last detection */
+	struct tracker	tracker[MAX_HANDS];
+	unsigned long	predicted_frames;
+
+	unsigned long	num_frames;	/* Frames processed so far */
+};
+
+/* Scale an odd aperture down, keeping it odd and at least 3 */
+static int scale_aperture(int size, int scale)
+{
+	size /= scale;
+	if (!(size & 1))
+		size++;
+
+	return MAX(size, 3);
+}
+
+/* Same segmentation chain as filter_and_threshold() on the CPU */
+static void init_gpu(struct hand_detector *det)
+{
+	struct gpu_config conf = {
+		.size		= cvGetSize(det->image),
+		.scale		= det->scale,
+		.skin		= &det->skin,
+		.smooth		= det->smooth_size,
+		.gaussian	= det->denoise == DENOISE_FULL,
+		.morph_radius	= det->morph_radius,
+	};
+
+	if (det->skin.type == SKIN_MODEL_LUT)
+		conf.median = det->denoise != DENOISE_FASTEST ?
+			det->smooth_size : 0;
+	else if (det->denoise == DENOISE_FULL)
+		conf.median = det->smooth_size;
+	else if (det->denoise == DENOISE_FAST)
+		conf.median = 5;
+
+	det->gpu = gpu_init(&conf);
+}
+
+void hand_config_init(struct hand_config *conf)
+{
+	memset(conf, 0, sizeof(*conf));
+	conf->scale = 1;
+	conf->denoise = DENOISE_FULL;
+	conf->skin_type = SKIN_MODEL_HSV;
+	conf->change_level = CHANGE_LEVEL;
+	conf->max_hands = 1;
+}
+
+static int check_config(const struct hand_config *conf, int width,
+			int height)
+{
+	if (conf->scale < 1 || conf->scale > MAX_SCALE ||
+	    conf->denoise < DENOISE_FASTEST || conf->denoise > DENOISE_FULL ||
+	    conf->roi_rescan < 0 || conf->track_rescan < 0 ||
+	    conf->change_refresh < 0 || conf->change_level <= 0 ||
+	    conf->detect_interval < 0 ||
+	    conf->max_hands < 1 || conf->max_hands > MAX_HANDS ||
+	    conf->seg_threads < 0 || conf->seg_threads > MAX_SEG_THREADS ||
+	    width < conf->scale || height < conf->scale)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Rows a tile processes past each side of its own, so that they are the
+ * same as with a single pass: the apertures of the two smoothing filters
+ * plus the opening and the final dilation
+ */
+static int tile_halo(const struct hand_detector *det)
+{
+	return det->smooth_size + 2 * det->morph_radius + 3;
+}
+
+/*
+ * Allocate n segmentation tiles for a window of the given size, and the
+ * threads running them besides the caller of hand_detector_process()
+ */
+static int init_tiles(struct hand_detector *det, CvSize work, int n)
+{
+	struct seg_tile *t;
+	CvSize size;
+	int i;
+
+	det->tiles = calloc(n, sizeof(*det->tiles));
+	if (!det->tiles)
+		return -1;
+	det->num_tiles = n;
+
+	/* Windows too small for n tiles use fewer, with more rows */
+	size.width = work.width;
+	size.height = MIN(MAX((work.height + n - 1) / n, 2 * TILE_MIN_ROWS) +
+			  2 * tile_halo(det), work.height);
+
+	for (i = 0; i < n; i++) {
+		t = &det->tiles[i];
+		t->buf.src = cvCreateImageHeader(cvGetSize(det->image), 8, 3);
+		t->buf.thr = cvCreateImage(size, 8, 1);
+		t->buf.mask = &t->mask;
+		if (!t->buf.src || !t->buf.thr ||
+		    mask_init(&t->mask, size.width, size.height) < 0)
+			return -1;
+		if (det->scale > 1 &&
+		    !(t->buf.small = cvCreateImage(size, 8, 3)))
+			return -1;
+		if (det->skin.type == SKIN_MODEL_HSV &&
+		    !(t->buf.temp3 = cvCreateImage(size, 8, 3)))
+			return -1;
+#if defined(CHECK_SKIN_THRESHOLD)
+		if (!(t->buf.temp1 = cvCreateImage(size, 8, 1)))
+			return -1;
+#endif
+	}
+
+	return task_pool_init(&det->tile_pool, n - 1);
+}
+
+static void free_tiles(struct hand_detector *det)
+{
+	struct seg_tile *t;
+	int i;
+
+	if (det->tile_pool.threads)
+		task_pool_free(&det->tile_pool);
+
+	for (i = 0; i < det->num_tiles; i++) {
+		t = &det->tiles[i];
+		if (t->buf.src)
+			cvReleaseImageHeader(&t->buf.src);
+		if (t->buf.thr)
+			cvReleaseImage(&t->buf.thr);
+		if (t->buf.small)
+			cvReleaseImage(&t->buf.small);
+		if (t->buf.temp3)
+			cvReleaseImage(&t->buf.temp3);
+		if (t->buf.temp1)
+			cvReleaseImage(&t->buf.temp1);
+		mask_free(&t->mask);
+	}
+	free(det->tiles);
+}
+
+/*
+ * Create a detector for frames of width x height pixels. Returns 0, or
+ * a negative enum hand_error, in which case *detp is left unchanged.
+ */
+int hand_detector_create(struct hand_detector **detp,
+			 const struct hand_config *conf, int width,
+			 int height)
+{
+	struct hand_detector *det;
+	CvSize size = cvSize(width, height);
+	CvSize work;
+	int r, n, err = -HAND_ENOMEM;
+
+	if (check_config(conf, width, height) < 0)
+		return -HAND_EINVAL;
+
+	det = calloc(1, sizeof(*det));
+	if (!det)
+		return -HAND_ENOMEM;
+
+	det->scale = conf->scale;
+	det->denoise = conf->denoise;
+	det->skin.type = conf->skin_type;
+	det->roi_rescan = conf->roi_rescan;
+	det->track_rescan = conf->track_rescan;
+	det->change_refresh = conf->change_refresh;
+	det->change_level = conf->change_level;
+	det->keep_mask = conf->keep_mask;
+	det->max_hands = conf->max_hands;
+	det->detect_interval = conf->detect_interval;
+	det->filter = conf->filter || conf->detect_interval > 1;
+
+	work = cvSize(size.width / det->scale, size.height / det->scale);
+
+	/* Pixels are set for each frame, they are never copied */
+	det->image = cvCreateImageHeader(size, 8, 3);
+	det->thr_image = cvCreateImage(work, 8, 1);
+	det->temp_image1 = cvCreateImage(work, 8, 1);
+	if (!det->image || !det->thr_image || !det->temp_image1)
+		goto err;
+	if (det->skin.type == SKIN_MODEL_HSV &&
+	    !(det->temp_image3 = cvCreateImage(work, 8, 3)))
+		goto err;
+	if (det->scale > 1) {
+		r = REFINE_RADIUS * det->scale;
+		det->small_image = cvCreateImage(work, 8, 3);
+		det->refine_image = cvCreateImage(cvSize(2 * r + 1, 2 * r + 1),
+						  8, 1);
+		if (!det->small_image || !det->refine_image)
+			goto err;
+	}
+
+	det->smooth_size = scale_aperture(11, det->scale);
+	det->morph_radius = scale_aperture(9, det->scale) / 2;
+	if (mask_init(&det->mask, work.width, work.height) < 0)
+		goto err;
+	if (conf->seg_threads > 1 &&
+	    init_tiles(det, work, conf->seg_threads) < 0)
+		goto err;
+	det->contour_st = cvCreateMemStorage(STORAGE_BLOCK_SIZE);
+	det->hull_st = cvCreateMemStorage(STORAGE_BLOCK_SIZE);
+	det->temp_st = cvCreateMemStorage(STORAGE_BLOCK_SIZE);
+	det->defects_st = cvCreateMemStorage(STORAGE_BLOCK_SIZE);
+	if (!det->contour_st || !det->hull_st || !det->temp_st ||
+	    !det->defects_st)
+		goto err;
+	if (det->change_refresh) {
+		n = ((size.width + CHANGE_STEP - 1) / CHANGE_STEP) *
+			((size.height + CHANGE_STEP - 1) / CHANGE_STEP);
+		det->thumb = malloc(n);
+		det->thumb_next = malloc(n);
+		if (!det->thumb || !det->thumb_next)
+			goto err;
+	}
+
+	err = -HAND_ESKIN;
+	if (skin_hsv_init(&det->skin.hsv, SKIN_HSV_MIN, SKIN_HSV_MAX) < 0)
+		goto err;
+
+	if (det->skin.type == SKIN_MODEL_LUT) {
+		err = -HAND_ELUT;
+		if (!conf->skin_lut_file)
+			skin_lut_from_hsv(&det->skin.lut, &det->skin.hsv);
+		else if (skin_lut_load(&det->skin.lut,
+				       conf->skin_lut_file) < 0)
+			goto err;
+	}
+
+	det->model = &det->skin;
+	if (conf->calibrate) {
+		err = -HAND_ENOMEM;
+		if (calib_start(&det->calib, &det->skin) < 0)
+			goto err;
+		det->calibrate = 1;
+	}
+
+	/* Without a usable device, segmentation stays on the CPU */
+	if (conf->use_gpu)
+		init_gpu(det);
+
+	*detp = det;
+	return 0;
+
+err:
+	hand_detector_destroy(det);
+	return err;
+}
+
+void hand_detector_destroy(struct hand_detector *det)
+{
+	if (det->image)
+		cvReleaseImageHeader(&det->image);
+	if (det->thr_image)
+		cvReleaseImage(&det->thr_image);
+	if (det->temp_image1)
+		cvReleaseImage(&det->temp_image1);
+	if (det->temp_image3)
+		cvReleaseImage(&det->temp_image3);
+	if (det->small_image)
+		cvReleaseImage(&det->small_image);
+	if (det->refine_image)
+		cvReleaseImage(&det->refine_image);
+	mask_free(&det->mask);
+	mask_labels_free(&det->labels);
+	free_tiles(det);
+	if (det->calibrate)
+		calib_stop(&det->calib);
+	if (det->gpu)
+		gpu_release(det->gpu);
+	free(det->thumb);
+	free(det->thumb_next);
+	free(det->finger_buf);
+	if (det->contour_st)
+		cvReleaseMemStorage(&det->contour_st);
+	if (det->hull_st)
+		cvReleaseMemStorage(&det->hull_st);
+	if (det->temp_st)
+		cvReleaseMemStorage(&det->temp_st);
+	if (det->defects_st)
+		cvReleaseMemStorage(&det->defects_st);
+	free(det);
+}
+
+/* Return the number of bytes handed out by a storage since last clear */
+static size_t storage_used(CvMemStorage *st)
+{
+	CvMemBlock *block;
+	size_t used = 0;
+
+	if (!st->top)
+		return 0;
+
+	for (block = st->bottom; block != st->top; block = block->next)
+		used += st->block_size - sizeof(CvMemBlock);
+
+	return used + st->block_size - sizeof(CvMemBlock) - st->free_space;
+}
+
+/* Return the number of bytes allocated from the system by a storage */
+static size_t storage_allocated(CvMemStorage *st)
+{
+	CvMemBlock *block;
+	size_t size = 0;
+
+	for (block = st->bottom; block; block = block->next)
+		size += st->block_size;
+
+	return size;
+}
+
+static void reset_storage(CvMemStorage **st)
+{
+	if (storage_allocated(*st) > STORAGE_HIGH_WATER) {
+		cvReleaseMemStorage(st);
+		*st = cvCreateMemStorage(STORAGE_BLOCK_SIZE);
+	} else {
+		cvClearMemStorage(*st);
+	}
+}
+
+/*
+ * Release all the sequences allocated during the current frame. Clearing
+ * a storage only rewinds its block list, so the memory is reused by the
+ * next frame without going back to the allocator.
+ */
+static void end_frame(struct hand_detector *det)
+{
+	size_t used, size;
+
+	used = storage_used(det->contour_st) + storage_used(det->hull_st) +
+		storage_used(det->temp_st) + storage_used(det->defects_st);
+	if (used > det->storage_peak)
+		det->storage_peak = used;
+
+	/* Storages only allocate when they need a new block */
+	size = storage_allocated(det->contour_st) +
+		storage_allocated(det->hull_st) +
+		storage_allocated(det->temp_st) +
+		storage_allocated(det->defects_st);
+	if (size > det->storage_size)
+		det->alloc_frames++;
+#if defined(DEBUG_ALLOCS)
+	assert(det->num_frames < ALLOC_WARMUP || size <= det->storage_size);
+#endif
+
+	reset_storage(&det->contour_st);
+	reset_storage(&det->hull_st);
+	reset_storage(&det->temp_st);
+	reset_storage(&det->defects_st);
+
+	det->storage_size = storage_allocated(det->contour_st) +
+		storage_allocated(det->hull_st) +
+		storage_allocated(det->temp_st) +
+		storage_allocated(det->defects_st);
+
+	/* Sequences are gone with their storage */
+	memset(det->contour, 0, sizeof(det->contour));
+	memset(det->hull, 0, sizeof(det->hull));
+}
+
+/* Bounding box of the last hands, moved as their trackers predict */
+static CvRect hands_rect(const struct hand_detector *det)
+{
+	CvRect r, box = cvRect(0, 0, 0, 0);
+	CvPoint c;
+	int i, t, x2, y2;
+
+	for (i = 0; i < det->num_rects; i++) {
+		r = det->hand_rect[i];
+		t = det->rect_tracker[i];
+		if (det->filter && t >= 0 && det->tracker[t].valid) {
+			c = tracker_center(&det->tracker[t]);
+			r.x += c.x - det->rect_center[i].x;
+			r.y += c.y - det->rect_center[i].y;
+		}
+
+		if (!i) {
+			box = r;
+			continue;
+		}
+		x2 = MAX(box.x + box.width, r.x + r.width);
+		y2 = MAX(box.y + box.height, r.y + r.height);
+		box.x = MIN(box.x, r.x);
+		box.y = MIN(box.y, r.y);
+		box.width = x2 - box.x;
+		box.height = y2 - box.y;
+	}
+
+	return box;
+}
+
+/*
+ * Select the window processed by the segmentation and contour stages.
+ * The whole frame is scanned when tracking is disabled, when the hands
+ * were lost and every roi_rescan frames, so that new hands appearing
+ * elsewhere are eventually found.
+ */
+static void begin_roi(struct hand_detector *det)
+{
+	CvSize size = cvGetSize(det->image);
+	CvRect r;
+	int mx, my, x2, y2;
+
+	if (!det->roi_rescan || !det->roi_valid ||
+	    ++det->roi_frames >= det->roi_rescan) {
+		det->roi_frames = 0;
+		det->roi = cvRect(0, 0, size.width, size.height);
+		det->work_roi = cvRect(0, 0, det->thr_image->width,
+				       det->thr_image->height);
+		return;
+	}
+
+	/* Follows the motion predicted since the hands were last seen */
+	r = hands_rect(det);
+
+	mx = r.width * ROI_MARGIN / 100 + ROI_BORDER;
+	my = r.height * ROI_MARGIN / 100 + ROI_BORDER;
+
+	x2 = MIN(r.x + r.width + mx, size.width);
+	y2 = MIN(r.y + r.height + my, size.height);
+	r.x = MAX(r.x - mx, 0);
+	r.y = MAX(r.y - my, 0);
+	if (x2 <= r.x || y2 <= r.y) {
+		/* Predicted out of the frame */
+		det->roi_valid = 0;
+		begin_roi(det);
+		return;
+	}
+
+	/* Same window in the downsampled images, rounded outwards */
+	x2 = MIN((x2 + det->scale - 1) / det->scale, det->thr_image->width);
+	y2 = MIN((y2 + det->scale - 1) / det->scale, det->thr_image->height);
+	r.x /= det->scale;
+	r.y /= det->scale;
+	det->work_roi = cvRect(r.x, r.y, x2 - r.x, y2 - r.y);
+
+	/*
+	 * Aligned on the downsampling grid, so that the resize averages
+	 * the same scale x scale blocks as a full frame, and as the GPU
+	 */
+	det->roi = cvRect(r.x * det->scale, r.y * det->scale,
+			  (x2 - r.x) * det->scale, (y2 - r.y) * det->scale);
+
+	/* The mask outside the window must not keep old detections */
+	cvZero(det->thr_image);
+
+	cvSetImageROI(det->image, det->roi);
+	cvSetImageROI(det->thr_image, det->work_roi);
+	cvSetImageROI(det->temp_image1, det->work_roi);
+	if (det->temp_image3)
+		cvSetImageROI(det->temp_image3, det->work_roi);
+	if (det->small_image)
+		cvSetImageROI(det->small_image, det->work_roi);
+}
+
+static void end_roi(struct hand_detector *det)
+{
+	int i;
+
+	cvResetImageROI(det->image);
+	cvResetImageROI(det->thr_image);
+	cvResetImageROI(det->temp_image1);
+	if (det->temp_image3)
+		cvResetImageROI(det->temp_image3);
+	if (det->small_image)
+		cvResetImageROI(det->small_image);
+
+	/* Track the hands in the next frame, or rescan if they were lost */
+	det->roi_valid = det->num_hands > 0;
+	det->num_rects = det->num_hands;
+	for (i = 0; i < det->num_hands; i++) {
+		det->hand_rect[i] = cvBoundingRect(det->contour[i], 1);
+		det->rect_tracker[i] = -1;
+	}
+}
+
+/*
+ * The median of a 0/255 mask is a majority vote, so it is the same as a
+ * box filter thresholded at half range, borders included, and the box
+ * filter uses running sums instead of per-pixel histograms.
+ */
+static void mask_median(IplImage *mask, int k)
+{
+	cvSmooth(mask, mask, CV_BLUR, k, k, 0, 0);
+	cvThreshold(mask, mask, 127, 255, CV_THRESH_BINARY);
+}
+
+/* Smooth the colour image src into dst */
+static void denoise(struct hand_detector *det, IplImage *src,
+		    IplImage *dst)
+{
+	int k = det->smooth_size;
+
+	switch (det->denoise) {
+	case DENOISE_FULL:
+		/* Soften image */
+		cvSmooth(src, dst, CV_GAUSSIAN, k, k, 0, 0);
+		/* Remove some impulsive noise */
+		cvSmooth(dst, dst, CV_MEDIAN, k, k, 0, 0);
+		break;
+	case DENOISE_FAST:
+		cvSmooth(src, dst, CV_BLUR, k, k, 0, 0);
+		cvSmooth(dst, dst, CV_MEDIAN, 5, 5, 0, 0);
+		break;
+	case DENOISE_FASTEST:
+		cvSmooth(src, dst, CV_BLUR, k, k, 0, 0);
+		break;
+	}
+}
+
+static void segment_window(struct hand_detector *det,
+			   const struct seg_buffers *buf)
+{
+	IplImage *src = buf->src;
+	int k = det->smooth_size;
+
+	if (det->scale > 1) {
+		cvResize(buf->src, buf->small, CV_INTER_AREA);
+		src = buf->small;
+	}
+
+	if (det->skin.type == SKIN_MODEL_LUT) {
+		/*
+		 * The lookup table classifies raw pixels, so noise is
+		 * removed from the 1 channel mask instead of the frame
+		 */
+		skin_threshold(det->model, src, buf->thr);
+		if (det->denoise != DENOISE_FASTEST)
+			mask_median(buf->thr, k);
+	} else {
+		denoise(det, src, buf->temp3);
+
+		/*
+		 * Apply threshold on HSV values to detect skin color. The
+		 * conversion is fused with the range test, so the HSV image
+		 * is never stored. Define CHECK_SKIN_THRESHOLD to compare
+		 * the result with the plain OpenCV implementation.
+		 */
+		skin_threshold(det->model, buf->temp3, buf->thr);
+
+#if defined(CHECK_SKIN_THRESHOLD)
+		cvCvtColor(buf->temp3, buf->temp3, CV_BGR2HSV);
+		cvInRangeS(buf->temp3, SKIN_HSV_MIN, SKIN_HSV_MAX, buf->temp1);
+		cvCmp(buf->temp1, buf->thr, buf->temp1, CV_CMP_NE);
+		if (cvCountNonZero(buf->temp1))
+			fprintf(stderr, "Skin threshold mismatch on %d pixels\n",
+				cvCountNonZero(buf->temp1));
+#endif
+	}
+
+	/*
+	 * Apply morphological opening on the packed mask, 64 pixels per
+	 * operation. The 3x3 Gaussian that used to follow made non-zero
+	 * every pixel next to the mask, which is what contour search sees,
+	 * so it becomes a 3x3 dilation.
+	 */
+	mask_pack(buf->mask, buf->thr);
+	mask_erode(buf->mask, det->morph_radius);
+	mask_dilate(buf->mask, det->morph_radius);
+	mask_dilate(buf->mask, 1);
+}
+
+/*
+ * Segment the rows of one horizontal tile of the window, with its halo,
+ * in the tile's own images. Only the rows of the tile are copied to the
+ * mask of the detector, so tiles never write the same memory.
+ */
+static void segment_tile(void *arg, int index)
+{
+	struct hand_detector *det = arg;
+	struct seg_tile *tile = &det->tiles[index];
+	CvRect roi = det->roi, work = det->work_roi, r;
+	int halo = tile_halo(det);
+	int y0 = work.height * index / det->num_tiles_used;
+	int y1 = work.height * (index + 1) / det->num_tiles_used;
+	int e0 = MAX(y0 - halo, 0), e1 = MIN(y1 + halo, work.height);
+	int y;
+
+	/* Input rows in frame coordinates, as the single pass resizes */
+	r.x = roi.x;
+	r.width = roi.width;
+	r.y = roi.y + e0 * roi.height / work.height;
+	r.height = roi.y + e1 * roi.height / work.height - r.y;
+	cvSetData(tile->buf.src, det->image->imageData,
+		  det->image->widthStep);
+	cvSetImageROI(tile->buf.src, r);
+
+	r = cvRect(0, 0, work.width, e1 - e0);
+	cvSetImageROI(tile->buf.thr, r);
+	if (tile->buf.small)
+		cvSetImageROI(tile->buf.small, r);
+	if (tile->buf.temp3)
+		cvSetImageROI(tile->buf.temp3, r);
+	if (tile->buf.temp1)
+		cvSetImageROI(tile->buf.temp1, r);
+
+	segment_window(det, &tile->buf);
+
+	for (y = y0; y < y1; y++)
+		memcpy(mask_row(&det->mask, y), mask_row(&tile->mask, y - e0),
+		       det->mask.words * sizeof(uint64_t));
+}
+
+static void segment_cpu(struct hand_detector *det)
+{
+	struct seg_buffers buf = {
+		.src	= det->image,
+		.small	= det->small_image,
+		.temp3	= det->temp_image3,
+		.temp1	= det->temp_image1,
+		.thr	= det->thr_image,
+		.mask	= &det->mask,
+	};
+	int n = MIN(det->num_tiles, det->work_roi.height / TILE_MIN_ROWS);
+
+	if (n < 2) {
+		segment_window(det, &buf);
+		return;
+	}
+
+	/* Tiles fill the rows, mask_pack() would set the size */
+	det->mask.width = MIN(det->work_roi.width, det->mask.max_width);
+	det->mask.height = MIN(det->work_roi.height, det->mask.max_height);
+	det->num_tiles_used = n;
+	task_pool_run(&det->tile_pool, segment_tile, det, n);
+}
+
+static void filter_and_threshold(struct hand_detector *det)
+{
+	/*
+	 * The device hands back the packed mask. After a device error the
+	 * CPU takes over for good, hand_detector_stats() tells it.
+	 */
+	if (det->gpu && gpu_segment(det->gpu, det->image, det->work_roi,
+				    &det->mask) < 0) {
+		gpu_release(det->gpu);
+		det->gpu = NULL;
+	}
+
+	if (!det->gpu)
+		segment_cpu(det);
+
+	/* The 8-bit mask is only needed to show it */
+	if (det->keep_mask)
+		mask_unpack(&det->mask, det->thr_image);
+}
+
+static void scale_contour(CvSeq *contour, int scale)
+{
+	CvPoint *p;
+	int i, half = scale / 2;
+
+	for (i = 0; i < contour->total; i++) {
+		p = CV_GET_SEQ_ELEM(CvPoint, contour, i);
+		p->x = p->x * scale + half;
+		p->y = p->y * scale + half;
+	}
+}
+
+/*
+ * Outer border of the blob through seed, a mask pixel whose west
+ * neighbour is clear, as cvFindContours() with CV_CHAIN_APPROX_SIMPLE
+ * would find it
+ */
+static CvSeq *trace_border(struct hand_detector *det, CvPoint seed)
+{
+	CvPoint offset = cvPoint(det->work_roi.x, det->work_roi.y);
+	CvSeqWriter writer;
+
+	cvStartWriteSeq(CV_SEQ_POLYGON, sizeof(CvContour), sizeof(CvPoint),
+			det->temp_st, &writer);
+	mask_trace(&det->mask, seed, offset, &writer);
+	return cvEndWriteSeq(&writer);
+}
+
+/*
+ * Follow the border of the hand found in the previous frame, at a cost
+ * proportional to its length instead of the size of the mask. Returns
+ * NULL when a full contour search is needed.
+ */
+static CvSeq *track_contour(struct hand_detector *det, geom_area_t *area)
+{
+	CvPoint offset = cvPoint(det->work_roi.x, det->work_roi.y);
+	CvPoint seed;
+	CvSeq *contour;
+	geom_area_t change;
+
+	/* Only one border is followed */
+	if (!det->track_rescan || !det->track_valid || det->max_hands > 1 ||
+	    ++det->track_frames >= det->track_rescan)
+		return NULL;
+
+	/* The mask only covers the processed window */
+	seed = cvPoint(det->track_seed.x - offset.x,
+		       det->track_seed.y - offset.y);
+	if (mask_find_border(&det->mask, &seed, TRACK_BAND) < 0)
+		return NULL;
+
+	contour = trace_border(det, seed);
+
+	*area = geom_contour_area(contour);
+	change = *area > det->track_area ? *area - det->track_area :
+		det->track_area - *area;
+	if (change * 100 > TRACK_AREA_CHANGE * det->track_area)
+		return NULL;
+
+	return contour;
+}
+
+/*
+ * Keep the max_hands largest contours in sorted arrays, in a single
+ * pass with at most max_hands moves per contour. Returns their number.
+ */
+static int select_contours(struct hand_detector *det, CvSeq *contours,
+			   CvSeq **selected, geom_area_t *areas)
+{
+	CvSeq *tmp;
+	geom_area_t area;
+	int i, n = 0;
+
+	for (tmp = contours; tmp; tmp = tmp->h_next) {
+		area = geom_contour_area(tmp);
+		if (area <= 0 || (n == det->max_hands && area <= areas[n - 1]))
+			continue;
+
+		if (n < det->max_hands)
+			n++;
+		for (i = n - 1; i > 0 && areas[i - 1] < area; i--) {
+			selected[i] = selected[i - 1];
+			areas[i] = areas[i - 1];
+		}
+		selected[i] = tmp;
+		areas[i] = area;
+	}
+
+	/* Smaller blobs are noise or parts of the scene, not hands */
+	while (n > 1 && areas[n - 1] * 100 < HAND_AREA_RATIO * areas[0])
+		n--;
+
+	return n;
+}
+
+/*
+ * Same selection as select_contours() on the connected components of the
+ * mask, which one scan labels with their areas. Only the borders of the
+ * selected components are traced, however many blobs the scene has.
+ * Returns the number of contours, or -1 if labelling failed.
+ */
+static int select_blobs(struct hand_detector *det, CvSeq **selected,
+			geom_area_t *areas)
+{
+	const struct mask_blob *blobs, *top[MAX_HANDS];
+	int i, k, num, n = 0;
+
+	num = mask_label(&det->mask, &det->labels);
+	if (num < 0)
+		return -1;
+	blobs = det->labels.blobs;
+
+	for (i = 0; i < num; i++) {
+		if (n == det->max_hands && blobs[i].area <= top[n - 1]->area)
+			continue;
+
+		if (n < det->max_hands)
+			n++;
+		for (k = n - 1; k > 0 && top[k - 1]->area < blobs[i].area; k--)
+			top[k] = top[k - 1];
+		top[k] = &blobs[i];
+	}
+
+	while (n > 1 &&
+	       top[n - 1]->area * 100 < HAND_AREA_RATIO * top[0]->area)
+		n--;
+
+	/* Blobs without an inside, lines or single pixels, are dropped */
+	for (i = 0, k = 0; i < n; i++) {
+		selected[k] = trace_border(det, top[i]->start);
+		areas[k] = geom_contour_area(selected[k]);
+		if (areas[k] > 0)
+			k++;
+	}
+
+	return k;
+}
+
+static void find_contour(struct hand_detector *det)
+{
+	CvSeq *contours, *selected[MAX_HANDS];
+	geom_area_t areas[MAX_HANDS];
+	int i, n = 0;
+
+	memset(det->hand, 0, sizeof(det->hand));
+
+	selected[0] = track_contour(det, &areas[0]);
+	if (selected[0])
+		n = 1;
+
+	if (!n) {
+		det->track_frames = 0;
+		n = select_blobs(det, selected, areas);
+	}
+
+	/* Out of memory for the labels, search all the contours instead */
+	if (n < 0) {
+		/* cvFindContours modifies its input, so work on a copy */
+		mask_unpack(&det->mask, det->temp_image1);
+		cvFindContours(det->temp_image1, det->temp_st, &contours,
+			       sizeof(CvContour), CV_RETR_EXTERNAL,
+			       CV_CHAIN_APPROX_SIMPLE,
+			       cvPoint(det->work_roi.x, det->work_roi.y));
+
+		n = select_contours(det, contours, selected, areas);
+	}
+
+	/*
+	 * Borders start on their first pixel in raster order, whose west
+	 * neighbour is clear: that is where the next frame follows it from
+	 */
+	det->track_valid = n > 0;
+	if (n) {
+		det->track_seed = *CV_GET_SEQ_ELEM(CvPoint, selected[0], 0);
+		det->track_area = areas[0];
+	}
+
+	/* Approximate contours with poly-lines */
+	for (i = 0; i < n; i++) {
+		det->contour[i] = cvApproxPoly(selected[i], sizeof(CvContour),
+					       det->contour_st,
+					       CV_POLY_APPROX_DP, 2, 1);
+
+		/* Later stages work in full resolution coordinates */
+		if (det->scale > 1)
+			scale_contour(det->contour[i], det->scale);
+	}
+	det->num_hands = n;
+}
+
+static void find_convex_hull(struct hand_detector *det, int slot)
+{
+	struct hand_result *hand = &det->hand[slot];
+	CvSeq *defects;
+	CvSeqReader reader;
+	CvConvexityDefect defect;
+	int i;
+	int x = 0, y = 0;
+	geom_len_t dist = 0;
+
+	det->hull[slot] = cvConvexHull2(det->contour[slot], det->hull_st,
+					CV_CLOCKWISE, 0);
+
+	if (det->hull[slot]) {
+
+		/* Get convexity defects of contour w.r.t. the convex hull */
+		defects = cvConvexityDefects(det->contour[slot],
+					     det->hull[slot], det->defects_st);
+
+		if (defects && defects->total) {
+			/* Average depth points to get hand center */
+			cvStartReadSeq(defects, &reader, 0);
+			for (i = 0; i < defects->total && i < NUM_DEFECTS; i++) {
+				CV_READ_SEQ_ELEM(defect, reader);
+				x += defect.depth_point->x;
+				y += defect.depth_point->y;
+
+				hand->defects[i] = *defect.depth_point;
+			}
+
+			x /= defects->total;
+			y /= defects->total;
+
+			hand->num_defects = MIN(defects->total, NUM_DEFECTS);
+			hand->center = cvPoint(x, y);
+
+			/* Compute hand radius as mean of distances of
+			   defects' depth point to hand center */
+			cvStartReadSeq(defects, &reader, 0);
+			for (i = 0; i < defects->total; i++) {
+				int d;
+
+				CV_READ_SEQ_ELEM(defect, reader);
+				d = (x - defect.depth_point->x) *
+					(x - defect.depth_point->x) +
+					(y - defect.depth_point->y) *
+					(y - defect.depth_point->y);
+
+				dist += geom_length(d);
+			}
+
+			hand->radius = geom_pixels(dist / defects->total);
+		}
+	}
+}
+
+/*
+ * Move a fingertip found at low resolution to the skin pixel farthest
+ * from the hand center, in a small window of the full resolution frame
+ */
+static CvPoint refine_finger(struct hand_detector *det, CvPoint c,
+			     CvPoint tip)
+{
+	CvSize size = cvGetSize(det->image);
+	int r = det->refine_image->width / 2;
+	int x, y, d, best = -1;
+	int x1 = MAX(tip.x - r, 0), y1 = MAX(tip.y - r, 0);
+	int x2 = MIN(tip.x + r + 1, size.width);
+	int y2 = MIN(tip.y + r + 1, size.height);
+	CvRect win = cvRect(x1, y1, x2 - x1, y2 - y1);
+	CvPoint ret = tip;
+	const uchar *m;
+
+	if (win.width <= 0 || win.height <= 0)
+		return tip;
+
+	cvSetImageROI(det->image, win);
+	cvSetImageROI(det->refine_image, cvRect(0, 0, win.width, win.height));
+	skin_threshold(det->model, det->image, det->refine_image);
+	cvResetImageROI(det->image);
+	cvResetImageROI(det->refine_image);
+
+	for (y = 0; y < win.height; y++) {
+		m = (uchar *)det->refine_image->imageData +
+			y * det->refine_image->widthStep;
+		for (x = 0; x < win.width; x++) {
+			if (!m[x])
+				continue;
+			d = (win.x + x - c.x) * (win.x + x - c.x) +
+				(win.y + y - c.y) * (win.y + y - c.y);
+			if (d > best) {
+				best = d;
+				ret = cvPoint(win.x + x, win.y + y);
+			}
+		}
+	}
+
+	return ret;
+}
+
+/* Move from a contour point to the neighbouring peak of the profile */
+static int climb_peak(const int *dist, int n, int p)
+{
+	int prev, next;
+
+	for (;;) {
+		prev = p ? p - 1 : n - 1;
+		next = p < n - 1 ? p + 1 : 0;
+		if (dist[prev] > dist[p])
+			p = prev;
+		else if (dist[next] > dist[p])
+			p = next;
+		else
+			return p;
+	}
+}
+
+/*
+ * Fingertips are found among the hull vertices, which are the only
+ * candidates, each moved to the peak of the distance profile it sits
+ * on. Peaks are then kept farthest first, suppressing those too close
+ * to a kept one, so that any number of fingers up to NUM_FINGERS is
+ * reported.
+ */
+static void find_fingers(struct hand_detector *det, int slot)
+{
+	struct hand_result *hand = &det->hand[slot];
+	CvSeq *contour = det->contour[slot];
+	CvSeq *hull = det->hull[slot];
+	int height = cvGetSize(det->image).height;
+	int cx = hand->center.x;
+	int cy = hand->center.y;
+	int n, i, j, p, dx, dy, min_dist, min_gap, num_peaks = 0;
+	int *xs, *ys, *dist, *peaks, tips[NUM_FINGERS];
+	CvSeqReader reader;
+	CvPoint point, *vertex;
+
+	if (!hull || !hull->total || !hand->num_defects)
+		return;
+
+	/*
+	 * Scratch arrays only grow, so that steady state frames do not
+	 * allocate. A storage block would cap the contour length.
+	 */
+	n = contour->total;
+	if (3 * n + hull->total > det->finger_size) {
+		xs = realloc(det->finger_buf,
+			     (3 * n + hull->total) * sizeof(*xs));
+		if (!xs)
+			return;
+		det->finger_buf = xs;
+		det->finger_size = 3 * n + hull->total;
+	}
+	xs = det->finger_buf;
+	ys = xs + n;
+	dist = ys + n;
+	peaks = dist + n;
+
+	cvStartReadSeq(contour, &reader, 0);
+	for (i = 0; i < n; i++) {
+		CV_READ_SEQ_ELEM(point, reader);
+		xs[i] = point.x;
+		ys[i] = point.y;
+	}
+
+	/* Squared distance profile, a loop the compiler vectorizes */
+	for (i = 0; i < n; i++)
+		dist[i] = (xs[i] - cx) * (xs[i] - cx) +
+			(ys[i] - cy) * (ys[i] - cy);
+
+	min_dist = hand->radius * FINGER_MIN_DIST / 100;
+	min_dist *= min_dist;
+
+	cvStartReadSeq(hull, &reader, 0);
+	for (i = 0; i < hull->total; i++) {
+		CV_READ_SEQ_ELEM(vertex, reader);
+		p = climb_peak(dist, n, cvSeqElemIdx(contour, vertex, NULL));
+		if (dist[p] < min_dist || ys[p] >= height - FINGER_EDGE)
+			continue;
+
+		/* Sorted farthest first, hulls have a few tens of vertices */
+		j = num_peaks++;
+		for (; j > 0 && dist[peaks[j - 1]] < dist[p]; j--)
+			peaks[j] = peaks[j - 1];
+		peaks[j] = p;
+	}
+
+	/* Non-maximum suppression, several vertices may share a peak */
+	min_gap = hand->radius * FINGER_MIN_GAP / 100;
+	min_gap *= min_gap;
+
+	for (i = 0; i < num_peaks && hand->num_fingers < NUM_FINGERS; i++) {
+		p = peaks[i];
+		for (j = 0; j < hand->num_fingers; j++) {
+			dx = xs[p] - xs[tips[j]];
+			dy = ys[p] - ys[tips[j]];
+			if (dx * dx + dy * dy < min_gap)
+				break;
+		}
+		if (j == hand->num_fingers)
+			tips[hand->num_fingers++] = p;
+	}
+
+	/* Report them in contour order, neighbours next to each other */
+	for (i = 1; i < hand->num_fingers; i++) {
+		p = tips[i];
+		for (j = i; j > 0 && tips[j - 1] > p; j--)
+			tips[j] = tips[j - 1];
+		tips[j] = p;
+	}
+
+	for (i = 0; i < hand->num_fingers; i++) {
+		hand->fingers[i] = cvPoint(xs[tips[i]], ys[tips[i]]);
+		if (det->scale > 1)
+			hand->fingers[i] = refine_finger(det, hand->center,
+							 hand->fingers[i]);
+	}
+}
+
+/*
+ * Tell whether the scene is the same as in the last frame where the hand
+ * was detected, so that the previous result still holds. Detection is
+ * forced every change_refresh frames to catch slow changes.
+ */
+static int frame_unchanged(struct hand_detector *det)
+{
+	const IplImage *img = det->image;
+	const uchar *p;
+	uchar *tmp;
+	int x, y, g, n = 0, changed = 0;
+
+	if (!det->change_refresh)
+		return 0;
+
+	for (y = 0; y < img->height; y += CHANGE_STEP) {
+		p = (const uchar *)img->imageData + y * img->widthStep;
+		for (x = 0; x < img->width; x += CHANGE_STEP, n++) {
+			g = (p[3 * x] + 2 * p[3 * x + 1] + p[3 * x + 2]) >> 2;
+			/* There is no reference before the first frame */
+			if (det->thumb_valid &&
+			    abs(g - det->thumb[n]) > det->change_level)
+				changed++;
+			det->thumb_next[n] = g;
+		}
+	}
+
+	if (det->thumb_valid && changed * 1000 <= CHANGE_SAMPLES * n &&
+	    ++det->change_frames < det->change_refresh) {
+		det->idle_frames++;
+		return 1;
+	}
+
+	/* This frame becomes the reference */
+	tmp = det->thumb;
+	det->thumb = det->thumb_next;
+	det->thumb_next = tmp;
+	det->thumb_valid = 1;
+	det->change_frames = 0;
+
+	return 0;
+}
+
+/*
+ * Run all the detection stages on det->image. Returns 0 if the frame
+ * was left unprocessed, keeping the previous result.
+ */
+static int detect(struct hand_detector *det)
+{
+	int i;
+
+	if (frame_unchanged(det))
+		return 0;
+
+	begin_roi(det);
+	STATS_TIME(STAGE_FILTER, filter_and_threshold(det));
+	STATS_TIME(STAGE_CONTOUR, find_contour(det));
+	end_roi(det);
+
+	/* Slots share nothing, each costs the same whatever the others */
+	for (i = 0; i < det->num_hands; i++) {
+		STATS_TIME(STAGE_HULL, find_convex_hull(det, i));
+		STATS_TIME(STAGE_FINGERS, find_fingers(det, i));
+	}
+
+	return 1;
+}
+
+/*
+ * Pair each detected hand, largest first, with the nearest free tracker
+ * within the gate, or else start over a free tracker for it. Trackers
+ * left without a hand are reset.
+ */
+static void match_trackers(struct hand_detector *det)
+{
+	int used[MAX_HANDS] = { 0 };
+	int i, t, best, spare, d, min = 0, gate;
+	struct tracker *tr;
+	CvPoint c, p;
+
+	for (i = 0; i < det->num_hands; i++) {
+		if (!det->hand[i].num_defects)
+			continue;
+
+		c = det->hand[i].center;
+		gate = TRACK_GATE * det->hand[i].radius;
+		best = spare = -1;
+
+		for (t = 0; t < det->max_hands; t++) {
+			tr = &det->tracker[t];
+			if (used[t])
+				continue;
+			if (!tr->valid) {
+				if (spare < 0 || det->tracker[spare].valid)
+					spare = t;
+				continue;
+			}
+
+			p = tracker_center(tr);
+			d = (p.x - c.x) * (p.x - c.x) +
+				(p.y - c.y) * (p.y - c.y);
+			if (d <= gate * gate && (best < 0 || d < min)) {
+				best = t;
+				min = d;
+			} else if (spare < 0) {
+				spare = t;
+			}
+		}
+
+		/* There are as many trackers as slots, one is left */
+		if (best < 0) {
+			best = spare;
+			tracker_reset(&det->tracker[best]);
+		}
+
+		used[best] = 1;
+		det->rect_tracker[i] = best;
+		det->rect_center[i] = c;
+		tracker_correct(&det->tracker[best], &det->hand[i]);
+		tracker_result(&det->tracker[best], &det->hand[i]);
+	}
+
+	for (t = 0; t < det->max_hands; t++)
+		if (!used[t])
+			tracker_reset(&det->tracker[t]);
+}
+
+/*
+ * With filtering, detections correct the trackers and the output is
+ * their estimate. Between detections, every detect_interval frames, the
+ * output is the prediction, which also moves the ROI along.
+ */
+static void detect_filtered(struct hand_detector *det)
+{
+	int t, n = 0;
+
+	for (t = 0; t < det->max_hands; t++) {
+		tracker_predict(&det->tracker[t]);
+		n += det->tracker[t].valid;
+	}
+
+	if (n && det->detect_interval > 1 &&
+	    ++det->detect_frames < det->detect_interval) {
+		memset(det->hand, 0, sizeof(det->hand));
+		for (t = 0, n = 0; t < det->max_hands; t++)
+			if (det->tracker[t].valid)
+				tracker_result(&det->tracker[t],
+					       &det->hand[n++]);
+		det->num_hands = n;
+		det->predicted_frames++;
+		return;
+	}
+	det->detect_frames = 0;
+
+	if (detect(det))
+		match_trackers(det);
+}
+
+static int check_frame(const struct hand_detector *det,
+		       const struct hand_frame *frame)
+{
+	if (!frame->data || frame->width != det->image->width ||
+	    frame->height != det->image->height ||
+	    frame->stride < 3 * frame->width)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Start sending a frame that will be processed next to the GPU, if one
+ * is in use, so that the transfer overlaps processing of the current
+ * frame. The frame must not change until it has been processed.
+ */
+void hand_detector_prefetch(struct hand_detector *det,
+			    const struct hand_frame *frame)
+{
+	IplImage header;
+
+	if (!det->gpu || check_frame(det, frame) < 0)
+		return;
+
+	cvInitImageHeader(&header, cvGetSize(det->image), 8, 3, 0, 4);
+	cvSetData(&header, frame->data, frame->stride);
+	gpu_upload(det->gpu, &header);
+}
+
+/*
+ * Detect the hand in a frame. The frame is only read during the call.
+ * The result, contour and mask of the previous frame are released.
+ */
+int hand_detector_process(struct hand_detector *det,
+			  const struct hand_frame *frame)
+{
+	if (check_frame(det, frame) < 0)
+		return -HAND_EINVAL;
+
+	end_frame(det);
+
+	/* A model published by calibration applies from a frame start */
+	if (det->calibrate)
+		det->model = calib_acquire(&det->calib);
+	if (det->gpu && gpu_set_skin(det->gpu, det->model) < 0) {
+		gpu_release(det->gpu);
+		det->gpu = NULL;
+	}
+
+	cvSetData(det->image, frame->data, frame->stride);
+	if (det->filter)
+		detect_filtered(det);
+	else
+		detect(det);
+
+	/* The largest hand is the most reliable sample */
+	if (det->calibrate && det->hand[0].num_defects &&
+	    !(det->num_frames % CALIB_INTERVAL))
+		calib_sample(&det->calib, det->image, det->hand[0].center,
+			     det->hand[0].radius);
+	det->num_frames++;
+
+	return 0;
+}
+
+/* Hands found in the last frame, at most hand_config.max_hands */
+int hand_detector_num_hands(const struct hand_detector *det)
+{
+	return det->num_hands;
+}
+
+/*
+ * Result for one hand of the last frame, largest first. The first one
+ * is always there, with no defects when there was no hand.
+ */
+const struct hand_result *hand_detector_result(const struct hand_detector *det,
+					       int index)
+{
+	return &det->hand[index];
+}
+
+/* Contour of a hand in the last frame, or NULL if not available */
+CvSeq *hand_detector_contour(const struct hand_detector *det, int index)
+{
+	return index < det->num_hands ? det->contour[index] : NULL;
+}
+
+/* Skin mask of the last frame, at detection resolution, if kept */
+const IplImage *hand_detector_mask(const struct hand_detector *det)
+{
+	return det->keep_mask ? det->thr_image : NULL;
+}
+
+void hand_detector_stats(const struct hand_detector *det,
+			 struct hand_stats *stats)
+{
+	stats->frames = det->num_frames;
+	stats->idle_frames = det->idle_frames;
+	stats->alloc_frames = det->alloc_frames;
+	stats->storage_peak = det->storage_peak;
+	stats->gpu = det->gpu != NULL;
+	stats->predicted_frames = det->predicted_frames;
+	stats->skin_updates = det->calibrate ?
+		atomic_load(&det->calib.updates) : 0;
+}
+
+const char *hand_strerror(int err)
+{
+	static const char *const errors[] = {
+		[HAND_OK]	= "Success",
+		[HAND_ENOMEM]	= "Out of memory",
+		[HAND_EINVAL]	= "Invalid configuration or frame",
+		[HAND_ESKIN]	= "Invalid skin thresholds",
+		[HAND_ELUT]	= "Error loading skin table",
+	};
+
+	err = -err;
+	if (err < 0 || err >= (int)(sizeof(errors) / sizeof(errors[0])))
+		return "Unknown error";
+
+	return errors[err];
+}
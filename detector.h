@@ -0,0 +1,127 @@
+/*
+ * Hand detector library
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+#include <stddef.h>
+
+#include <opencv2/core/core_c.h>
+
+#include "result.h"
+#include "skin.h"
+
+/* Default inclusive HSV bounds of skin color */
+#define SKIN_HSV_MIN	cvScalar(0, 55, 90, 255)
+#define SKIN_HSV_MAX	cvScalar(28, 175, 230, 255)
+
+#define MAX_SCALE	4	/* Largest detection downsampling */
+#define CHANGE_LEVEL	12	/* Default grey level change seen as motion */
+
+/*
+ * Denoise quality before the skin color test. DENOISE_FULL is the
+ * Gaussian plus median smoothing this detector was tuned with. Lower
+ * levels replace the Gaussian with a box filter, which costs the same
+ * per pixel at any aperture, and use a 5x5 median (DENOISE_FAST) or no
+ * median at all (DENOISE_FASTEST) for sites with little impulsive noise.
+ */
+enum denoise_quality {
+	DENOISE_FASTEST,
+	DENOISE_FAST,
+	DENOISE_FULL,
+};
+
+/* Most segmentation threads a detector may use */
+#define MAX_SEG_THREADS	64
+
+/* Errors returned by the detector functions, as negative values */
+enum hand_error {
+	HAND_OK,
+	HAND_ENOMEM,		/* Out of memory */
+	HAND_EINVAL,		/* Invalid configuration or frame */
+	HAND_ESKIN,		/* Skin thresholds can't be used */
+	HAND_ELUT,		/* Skin lookup table can't be loaded */
+};
+
+struct hand_config {
+	int		scale;		/* Detection runs at 1/scale size */
+	enum denoise_quality denoise;
+	enum skin_model_type skin_type;
+	const char	*skin_lut_file;	/* Calibrated lookup table, if any */
+	int		roi_rescan;	/* Full scan period, 0 disables ROI */
+	int		track_rescan;	/* Full contour search period */
+	int		change_refresh;	/* Max frames between detections */
+	int		change_level;	/* Grey level change that counts */
+	int		use_gpu;	/* Segment with OpenCL if possible */
+	int		keep_mask;	/* Keep an 8-bit copy of the mask */
+	int		calibrate;	/* Adapt the skin model to the hands */
+	int		filter;		/* Smooth results with a Kalman filter */
+	int		detect_interval; /* Detect every N frames, filtering */
+	int		max_hands;	/* Hands per frame, up to MAX_HANDS */
+	int		seg_threads;	/* 0 or 1 for one, up to MAX_SEG_THREADS */
+};
+
+/*
+ * A frame owned by the caller: 8-bit BGR pixels, read in place. stride
+ * is the distance in bytes between the starts of two rows.
+ */
+struct hand_frame {
+	unsigned char	*data;
+	int		width;
+	int		height;
+	int		stride;
+};
+
+struct hand_stats {
+	unsigned long	frames;		/* Frames processed */
+	unsigned long	idle_frames;	/* Left unprocessed, unchanged */
+	unsigned long	predicted_frames; /* Output by the filter alone */
+	unsigned long	alloc_frames;	/* Frames that had to allocate */
+	size_t		storage_peak;	/* Max bytes used by a single frame */
+	int		gpu;		/* Segmenting on the GPU */
+	unsigned long	skin_updates;	/* Models published by calibration */
+};
+
+/*
+ * A detector processes frames of one size, one at a time, and keeps
+ * tracking state between them. Detectors share no state, so several
+ * of them can run on different threads. No function prints, exits or
+ * touches any window.
+ */
+struct hand_detector;
+
+void hand_config_init(struct hand_config *conf);
+
+int hand_detector_create(struct hand_detector **det,
+			 const struct hand_config *conf, int width,
+			 int height);
+void hand_detector_prefetch(struct hand_detector *det,
+			    const struct hand_frame *frame);
+int hand_detector_process(struct hand_detector *det,
+			  const struct hand_frame *frame);
+int hand_detector_num_hands(const struct hand_detector *det);
+const struct hand_result *hand_detector_result(const struct hand_detector *det,
+					       int index);
+CvSeq *hand_detector_contour(const struct hand_detector *det, int index);
+const IplImage *hand_detector_mask(const struct hand_detector *det);
+void hand_detector_stats(const struct hand_detector *det,
+			 struct hand_stats *stats);
+void hand_detector_destroy(struct hand_detector *det);
+
+const char *hand_strerror(int err);
+
+#endif
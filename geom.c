@@ -0,0 +1,91 @@
+/*
+ * Contour geometry kernels
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <math.h>
+
+#include <opencv2/imgproc/imgproc_c.h>
+
+#include "geom.h"
+
+#if defined(FIXED_GEOMETRY)
+
+/* Square root rounded down, one result bit per iteration */
+static uint64_t isqrt(uint64_t n)
+{
+	uint64_t root = 0, bit = 1ULL << 62;
+
+	while (bit > n)
+		bit >>= 2;
+
+	while (bit) {
+		if (n >= root + bit) {
+			n -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return root;
+}
+
+/*
+ * Shoelace formula on the vertices. Coordinates fit in 16 bits, so the
+ * sum never overflows 64 bits for any contour of a frame.
+ */
+geom_area_t geom_contour_area(const CvSeq *contour)
+{
+	CvSeqReader reader;
+	CvPoint p, q, first;
+	int64_t sum = 0;
+	int i;
+
+	if (contour->total < 3)
+		return 0;
+
+	cvStartReadSeq(contour, &reader, 0);
+	CV_READ_SEQ_ELEM(first, reader);
+	p = first;
+	for (i = 1; i < contour->total; i++) {
+		CV_READ_SEQ_ELEM(q, reader);
+		sum += (int64_t)p.x * q.y - (int64_t)q.x * p.y;
+		p = q;
+	}
+	sum += (int64_t)p.x * first.y - (int64_t)first.x * p.y;
+
+	return (sum < 0 ? -sum : sum) / 2;
+}
+
+geom_len_t geom_length(int64_t squared)
+{
+	return isqrt((uint64_t)squared << (2 * GEOM_LEN_SHIFT));
+}
+
+#else
+
+geom_area_t geom_contour_area(const CvSeq *contour)
+{
+	return fabs(cvContourArea(contour, CV_WHOLE_SEQ, 0));
+}
+
+geom_len_t geom_length(int64_t squared)
+{
+	return sqrt(squared);
+}
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * Contour geometry kernels
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef GEOM_H
+#define GEOM_H
+
+#include <stdint.h>
+
+#include <opencv2/core/core_c.h>
+
+/*
+ * Areas and lengths measured on contours. The default build uses double
+ * precision, building with -DFIXED_GEOMETRY uses integers only, for
+ * processors where doubles are slow. Areas are in pixels in both cases,
+ * lengths are converted to pixels with geom_pixels().
+ */
+#if defined(FIXED_GEOMETRY)
+typedef int64_t geom_area_t;
+typedef int64_t geom_len_t;	/* GEOM_LEN_SHIFT fractional bits */
+#define GEOM_LEN_SHIFT	8
+#else
+typedef double geom_area_t;
+typedef double geom_len_t;
+#endif
+
+geom_area_t geom_contour_area(const CvSeq *contour);
+geom_len_t geom_length(int64_t squared);
+
+static inline int geom_pixels(geom_len_t len)
+{
+#if defined(FIXED_GEOMETRY)
+	return len >> GEOM_LEN_SHIFT;
+#else
+	return len;
+#endif
+}
+
+#endif
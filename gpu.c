@@ -0,0 +1,699 @@
+/*
+ * OpenCL segmentation backend
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "gpu.h"
+
+#if defined(ENABLE_OPENCL)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define CL_TARGET_OPENCL_VERSION	120
+#include <CL/cl.h>
+
+#define MAX_PLATFORMS	8
+#define MAX_APERTURE	31
+
+/*
+ * Work images are dense, 3 bytes per pixel, and sized by the global
+ * work size. Borders follow the CPU path: cvSmooth() replicates the edge
+ * pixels for the blurs and the medians, mask_median() included, and
+ * pixels outside the image are ignored by the morphology.
+ */
+static const char *gpu_source =
+"/* Average scale x scale blocks of the frame, as CV_INTER_AREA */\n"
+"__kernel void shrink(__global const uchar *src, int step,\n"
+"		     __global uchar *dst, int x0, int y0, int scale)\n"
+"{\n"
+"	int x = get_global_id(0), y = get_global_id(1);\n"
+"	int w = get_global_size(0);\n"
+"	int n = scale * scale, i, j, c, sum;\n"
+"	__global const uchar *s = src + (y0 + y) * scale * step +\n"
+"		(x0 + x) * scale * 3;\n"
+"\n"
+"	for (c = 0; c < 3; c++) {\n"
+"		sum = 0;\n"
+"		for (j = 0; j < scale; j++)\n"
+"			for (i = 0; i < scale; i++)\n"
+"				sum += s[j * step + i * 3 + c];\n"
+"		dst[(y * w + x) * 3 + c] = (sum + n / 2) / n;\n"
+"	}\n"
+"}\n"
+"\n"
+"/* One pass of a separable blur, along (dx, dy) */\n"
+"__kernel void smooth(__global const uchar *src, __global uchar *dst,\n"
+"		     __constant float *weights, int k, int dx, int dy)\n"
+"{\n"
+"	int x = get_global_id(0), y = get_global_id(1);\n"
+"	int w = get_global_size(0), h = get_global_size(1);\n"
+"	float acc[3] = { 0.0f, 0.0f, 0.0f };\n"
+"	int i, c, p;\n"
+"\n"
+"	for (i = 0; i < k; i++) {\n"
+"		p = clamp(y + (i - k / 2) * dy, 0, h - 1) * w +\n"
+"			clamp(x + (i - k / 2) * dx, 0, w - 1);\n"
+"		for (c = 0; c < 3; c++)\n"
+"			acc[c] += weights[i] * src[p * 3 + c];\n"
+"	}\n"
+"\n"
+"	for (c = 0; c < 3; c++)\n"
+"		dst[(y * w + x) * 3 + c] = (uchar)min(acc[c] + 0.5f, 255.0f);\n"
+"}\n"
+"\n"
+"/* k x k median of each channel, from a histogram of the window */\n"
+"__kernel void median(__global const uchar *src, __global uchar *dst,\n"
+"		     int k)\n"
+"{\n"
+"	int x = get_global_id(0), y = get_global_id(1);\n"
+"	int w = get_global_size(0), h = get_global_size(1);\n"
+"	ushort hist[256];	/* Up to MAX_APERTURE squared */\n"
+"	int i, j, c, v, n, p;\n"
+"\n"
+"	for (c = 0; c < 3; c++) {\n"
+"		for (v = 0; v < 256; v++)\n"
+"			hist[v] = 0;\n"
+"		for (j = -k / 2; j <= k / 2; j++) {\n"
+"			for (i = -k / 2; i <= k / 2; i++) {\n"
+"				p = clamp(y + j, 0, h - 1) * w +\n"
+"					clamp(x + i, 0, w - 1);\n"
+"				hist[src[p * 3 + c]]++;\n"
+"			}\n"
+"		}\n"
+"		for (v = 0, n = hist[0]; n <= k * k / 2; n += hist[++v])\n"
+"			;\n"
+"		dst[(y * w + x) * 3 + c] = v;\n"
+"	}\n"
+"}\n"
+"\n"
+"/* Same test as skin_hsv_threshold(), tables as in struct skin_hsv */\n"
+"__kernel void classify_hsv(__global const uchar *src, __global uchar *dst,\n"
+"			   __constant short *tab, int v_min, int v_max)\n"
+"{\n"
+"	int p = get_global_id(1) * get_global_size(0) + get_global_id(0);\n"
+"	int b = src[p * 3], g = src[p * 3 + 1], r = src[p * 3 + 2];\n"
+"	int v = max(max(b, g), r), d = v - min(min(b, g), r), n;\n"
+"\n"
+"	if (v == r)\n"
+"		n = g - b;\n"
+"	else if (v == g)\n"
+"		n = b - r + 2 * d;\n"
+"	else\n"
+"		n = r - g + 4 * d;\n"
+"\n"
+"	dst[p] = v >= v_min && v <= v_max &&\n"
+"		d >= tab[v] && d <= tab[256 + v] &&\n"
+"		n >= tab[512 + d] && n <= tab[768 + d] ? 255 : 0;\n"
+"}\n"
+"\n"
+"/* Same test as skin_lut_threshold() */\n"
+"__kernel void classify_lut(__global const uchar *src, __global uchar *dst,\n"
+"			   __constant uchar *bits, int shift)\n"
+"{\n"
+"	int p = get_global_id(1) * get_global_size(0) + get_global_id(0);\n"
+"	int idx = ((src[p * 3] >> shift) << (2 * (8 - shift))) |\n"
+"		((src[p * 3 + 1] >> shift) << (8 - shift)) |\n"
+"		(src[p * 3 + 2] >> shift);\n"
+"\n"
+"	dst[p] = (bits[idx >> 3] >> (idx & 7)) & 1 ? 255 : 0;\n"
+"}\n"
+"\n"
+"/* Median of a 0/255 mask: majority of the k x k window */\n"
+"__kernel void vote(__global const uchar *src, __global uchar *dst, int k)\n"
+"{\n"
+"	int x = get_global_id(0), y = get_global_id(1);\n"
+"	int w = get_global_size(0), h = get_global_size(1);\n"
+"	int i, j, n = 0;\n"
+"\n"
+"	for (j = -k / 2; j <= k / 2; j++)\n"
+"		for (i = -k / 2; i <= k / 2; i++)\n"
+"			n += src[clamp(y + j, 0, h - 1) * w +\n"
+"				 clamp(x + i, 0, w - 1)] != 0;\n"
+"\n"
+"	dst[y * w + x] = n > k * k / 2 ? 255 : 0;\n"
+"}\n"
+"\n"
+"/* One pass of a separable erosion or dilation, along (dx, dy) */\n"
+"__kernel void morph(__global const uchar *src, __global uchar *dst,\n"
+"		    int r, int dx, int dy, int erode)\n"
+"{\n"
+"	int x = get_global_id(0), y = get_global_id(1);\n"
+"	int w = get_global_size(0), h = get_global_size(1);\n"
+"	int i, xx, yy, v = src[y * w + x];\n"
+"\n"
+"	for (i = -r; i <= r; i++) {\n"
+"		xx = x + i * dx;\n"
+"		yy = y + i * dy;\n"
+"		if (xx < 0 || yy < 0 || xx >= w || yy >= h)\n"
+"			continue;\n"
+"		v = erode ? min(v, (int)src[yy * w + xx]) :\n"
+"			max(v, (int)src[yy * w + xx]);\n"
+"	}\n"
+"\n"
+"	dst[y * w + x] = v;\n"
+"}\n"
+"\n"
+"/* Pack the mask as struct bitmask, one work item per word */\n"
+"__kernel void pack(__global const uchar *src, __global ulong *dst,\n"
+"		   int width)\n"
+"{\n"
+"	int word = get_global_id(0), y = get_global_id(1);\n"
+"	int words = get_global_size(0), x, i;\n"
+"	ulong bits = 0;\n"
+"\n"
+"	for (i = 0; i < 64; i++) {\n"
+"		x = word * 64 + i;\n"
+"		if (x < width && src[y * width + x])\n"
+"			bits |= (ulong)1 << i;\n"
+"	}\n"
+"\n"
+"	dst[y * words + word] = bits;\n"
+"}\n";
+
+struct gpu_slot {
+	cl_mem		frame;
+	cl_event	uploaded;
+	const char	*data;		/* Host image being uploaded */
+	unsigned long	seq;
+};
+
+struct gpu {
+	struct gpu_config conf;
+	CvSize		work;		/* Size of the downsampled frames */
+	int		words;		/* Per row of the packed mask */
+	size_t		frame_bytes;
+
+	cl_context	context;
+	cl_command_queue queue;		/* Kernels and mask readback */
+	cl_command_queue upload_q;	/* Frame uploads */
+	cl_program	program;
+
+	cl_kernel	shrink;
+	cl_kernel	smooth;
+	cl_kernel	median;
+	cl_kernel	classify_hsv;
+	cl_kernel	classify_lut;
+	cl_kernel	vote;
+	cl_kernel	morph;
+	cl_kernel	pack;
+
+	struct gpu_slot	slots[2];	/* Double buffered frames */
+	unsigned long	seq;
+
+	cl_mem		img[2];		/* 3 channel work images */
+	cl_mem		mask[2];	/* 8-bit work masks */
+	cl_mem		bits;		/* Packed mask */
+	cl_mem		weights;	/* Blur kernel */
+	cl_mem		table;		/* Skin model */
+};
+
+#define ARG(k, i, v)	clSetKernelArg(k, i, sizeof(v), &(v))
+
+/* Same coefficients as cv::getGaussianKernel() with a default sigma */
+static void gaussian_weights(float *w, int k)
+{
+	static const float small[][7] = {
+		{ 0.25f, 0.5f, 0.25f },
+		{ 0.0625f, 0.25f, 0.375f, 0.25f, 0.0625f },
+		{ 0.03125f, 0.109375f, 0.21875f, 0.28125f, 0.21875f,
+		  0.109375f, 0.03125f },
+	};
+	double sigma = ((k - 1) * 0.5 - 1) * 0.3 + 0.8, sum = 0.0, x;
+	int i;
+
+	if (k <= 7) {
+		memcpy(w, small[k / 2 - 1], k * sizeof(*w));
+		return;
+	}
+
+	for (i = 0; i < k; i++) {
+		x = i - (k - 1) * 0.5;
+		w[i] = exp(-x * x / (2 * sigma * sigma));
+		sum += w[i];
+	}
+	for (i = 0; i < k; i++)
+		w[i] /= sum;
+}
+
+static cl_device_id find_device(void)
+{
+	cl_platform_id platforms[MAX_PLATFORMS];
+	cl_device_id device;
+	cl_uint i, n;
+
+	if (clGetPlatformIDs(MAX_PLATFORMS, platforms, &n) != CL_SUCCESS)
+		return NULL;
+
+	for (i = 0; i < n && i < MAX_PLATFORMS; i++)
+		if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1,
+				   &device, NULL) == CL_SUCCESS)
+			return device;
+
+	return NULL;
+}
+
+static cl_mem create_buffer(struct gpu *gpu, cl_mem_flags flags,
+			    size_t size, const void *data)
+{
+	cl_int err;
+	cl_mem mem;
+
+	if (data)
+		flags |= CL_MEM_COPY_HOST_PTR;
+
+	mem = clCreateBuffer(gpu->context, flags, size, (void *)data, &err);
+	return err == CL_SUCCESS ? mem : NULL;
+}
+
+static int create_kernels(struct gpu *gpu, cl_device_id device)
+{
+	cl_int err;
+
+	gpu->program = clCreateProgramWithSource(gpu->context, 1,
+						 &gpu_source, NULL, &err);
+	if (err != CL_SUCCESS ||
+	    clBuildProgram(gpu->program, 1, &device, NULL, NULL, NULL) !=
+	    CL_SUCCESS)
+		return -1;
+
+#define KERNEL(name)							\
+	do {								\
+		gpu->name = clCreateKernel(gpu->program, #name, &err);	\
+		if (err != CL_SUCCESS)					\
+			return -1;					\
+	} while (0)
+
+	KERNEL(shrink);
+	KERNEL(smooth);
+	KERNEL(median);
+	KERNEL(classify_hsv);
+	KERNEL(classify_lut);
+	KERNEL(vote);
+	KERNEL(morph);
+	KERNEL(pack);
+
+#undef KERNEL
+
+	return 0;
+}
+
+/* Classifier tables as read by the classify kernels */
+static const void *skin_table(const struct skin_model *skin, short *table,
+			      size_t *size)
+{
+	if (skin->type == SKIN_MODEL_LUT) {
+		*size = sizeof(skin->lut.bits);
+		return skin->lut.bits;
+	}
+
+	memcpy(table, skin->hsv.d_min, 256 * sizeof(short));
+	memcpy(table + 256, skin->hsv.d_max, 256 * sizeof(short));
+	memcpy(table + 512, skin->hsv.n_min, 256 * sizeof(short));
+	memcpy(table + 768, skin->hsv.n_max, 256 * sizeof(short));
+	*size = 1024 * sizeof(short);
+	return table;
+}
+
+static int create_buffers(struct gpu *gpu)
+{
+	const struct skin_model *skin = gpu->conf.skin;
+	size_t pixels = (size_t)gpu->work.width * gpu->work.height;
+	float weights[MAX_APERTURE];
+	short table[1024];
+	const void *data;
+	size_t size;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		gpu->slots[i].frame = create_buffer(gpu, CL_MEM_READ_ONLY,
+						    gpu->frame_bytes, NULL);
+		gpu->img[i] = create_buffer(gpu, CL_MEM_READ_WRITE,
+					    pixels * 3, NULL);
+		gpu->mask[i] = create_buffer(gpu, CL_MEM_READ_WRITE,
+					     pixels, NULL);
+		if (!gpu->slots[i].frame || !gpu->img[i] || !gpu->mask[i])
+			return -1;
+	}
+
+	gpu->bits = create_buffer(gpu, CL_MEM_WRITE_ONLY,
+				  (size_t)gpu->words * gpu->work.height *
+				  sizeof(uint64_t), NULL);
+
+	if (gpu->conf.smooth > MAX_APERTURE)
+		return -1;
+	if (gpu->conf.gaussian) {
+		gaussian_weights(weights, gpu->conf.smooth);
+	} else {
+		for (i = 0; i < gpu->conf.smooth; i++)
+			weights[i] = 1.0f / gpu->conf.smooth;
+	}
+	gpu->weights = create_buffer(gpu, CL_MEM_READ_ONLY,
+				     sizeof(weights), weights);
+
+	data = skin_table(skin, table, &size);
+	gpu->table = create_buffer(gpu, CL_MEM_READ_ONLY, size, data);
+
+	return gpu->bits && gpu->weights && gpu->table ? 0 : -1;
+}
+
+/* Returns NULL if there is no usable OpenCL GPU */
+struct gpu *gpu_init(const struct gpu_config *conf)
+{
+	struct gpu *gpu;
+	cl_device_id device;
+	cl_int err;
+
+	device = find_device();
+	if (!device)
+		return NULL;
+
+	gpu = calloc(1, sizeof(*gpu));
+	if (!gpu)
+		return NULL;
+
+	gpu->conf = *conf;
+	gpu->work = cvSize(conf->size.width / conf->scale,
+			   conf->size.height / conf->scale);
+	gpu->words = (gpu->work.width + 63) / 64;
+	/* Room for 8-bit BGR rows aligned on 4 bytes, as IplImage */
+	gpu->frame_bytes = (size_t)((conf->size.width * 3 + 3) & ~3) *
+		conf->size.height;
+
+	gpu->context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+	if (err != CL_SUCCESS)
+		goto err;
+
+	gpu->queue = clCreateCommandQueue(gpu->context, device, 0, &err);
+	if (err != CL_SUCCESS)
+		goto err;
+	gpu->upload_q = clCreateCommandQueue(gpu->context, device, 0, &err);
+	if (err != CL_SUCCESS)
+		goto err;
+
+	if (create_kernels(gpu, device) < 0 || create_buffers(gpu) < 0)
+		goto err;
+
+	return gpu;
+
+err:
+	gpu_release(gpu);
+	return NULL;
+}
+
+/* Wait for the upload in a slot to end, and free the slot */
+static void retire(struct gpu_slot *slot)
+{
+	if (slot->uploaded) {
+		clWaitForEvents(1, &slot->uploaded);
+		clReleaseEvent(slot->uploaded);
+		slot->uploaded = NULL;
+	}
+	slot->data = NULL;
+}
+
+static struct gpu_slot *find_slot(struct gpu *gpu, const IplImage *image)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (gpu->slots[i].data == image->imageData)
+			return &gpu->slots[i];
+
+	return NULL;
+}
+
+/*
+ * Start sending a frame to the device, in a free buffer or in place of
+ * the oldest frame. This does not wait for the transfer.
+ */
+void gpu_upload(struct gpu *gpu, const IplImage *image)
+{
+	struct gpu_slot *slot = &gpu->slots[0], *other = &gpu->slots[1];
+
+	if (find_slot(gpu, image) ||
+	    (size_t)image->imageSize > gpu->frame_bytes)
+		return;
+
+	if (slot->data && (!other->data || other->seq < slot->seq))
+		slot = other;
+	retire(slot);
+
+	if (clEnqueueWriteBuffer(gpu->upload_q, slot->frame, CL_FALSE, 0,
+				 image->imageSize, image->imageData, 0, NULL,
+				 &slot->uploaded) != CL_SUCCESS) {
+		slot->uploaded = NULL;
+		return;
+	}
+	clFlush(gpu->upload_q);
+
+	slot->data = image->imageData;
+	slot->seq = ++gpu->seq;
+}
+
+static cl_int run(struct gpu *gpu, cl_kernel kernel, size_t width,
+		  size_t height, cl_event *wait)
+{
+	size_t size[2] = { width, height };
+
+	return clEnqueueNDRangeKernel(gpu->queue, kernel, 2, NULL, size, NULL,
+				      wait ? 1 : 0, wait, NULL);
+}
+
+static cl_int blur(struct gpu *gpu, cl_mem *in, cl_mem *out,
+		   CvSize size)
+{
+	cl_int dx = 1, dy = 0, k = gpu->conf.smooth, err;
+	cl_mem tmp;
+	int pass;
+
+	for (pass = 0, err = CL_SUCCESS; pass < 2; pass++) {
+		err |= ARG(gpu->smooth, 0, *in);
+		err |= ARG(gpu->smooth, 1, *out);
+		err |= ARG(gpu->smooth, 2, gpu->weights);
+		err |= ARG(gpu->smooth, 3, k);
+		err |= ARG(gpu->smooth, 4, dx);
+		err |= ARG(gpu->smooth, 5, dy);
+		err |= run(gpu, gpu->smooth, size.width, size.height, NULL);
+
+		tmp = *in;
+		*in = *out;
+		*out = tmp;
+		dx = 0;
+		dy = 1;
+	}
+
+	return err;
+}
+
+static cl_int morph(struct gpu *gpu, cl_mem *in, cl_mem *out, CvSize size,
+		    cl_int r, cl_int erode)
+{
+	cl_int dx = 1, dy = 0, err;
+	cl_mem tmp;
+	int pass;
+
+	for (pass = 0, err = CL_SUCCESS; pass < 2; pass++) {
+		err |= ARG(gpu->morph, 0, *in);
+		err |= ARG(gpu->morph, 1, *out);
+		err |= ARG(gpu->morph, 2, r);
+		err |= ARG(gpu->morph, 3, dx);
+		err |= ARG(gpu->morph, 4, dy);
+		err |= ARG(gpu->morph, 5, erode);
+		err |= run(gpu, gpu->morph, size.width, size.height, NULL);
+
+		tmp = *in;
+		*in = *out;
+		*out = tmp;
+		dx = 0;
+		dy = 1;
+	}
+
+	return err;
+}
+
+/*
+ * Segment the roi of a frame, in downsampled coordinates, into mask.
+ * The frame is uploaded first unless gpu_upload() was already called
+ * for it. Returns -1 on device errors.
+ */
+int gpu_segment(struct gpu *gpu, const IplImage *image, CvRect roi,
+		struct bitmask *mask)
+{
+	const struct skin_model *skin = gpu->conf.skin;
+	struct gpu_slot *slot, *other;
+	CvSize size = cvSize(roi.width, roi.height);
+	cl_mem img = gpu->img[0], img_tmp = gpu->img[1];
+	cl_mem m = gpu->mask[0], m_tmp = gpu->mask[1], tmp;
+	cl_int step = image->widthStep, scale = gpu->conf.scale;
+	cl_int x0 = roi.x, y0 = roi.y, k, shift, width = roi.width;
+	cl_int err = CL_SUCCESS;
+
+	if (mask->words != gpu->words || !size.width || !size.height)
+		return -1;
+
+	gpu_upload(gpu, image);
+	slot = find_slot(gpu, image);
+	if (!slot)
+		return -1;
+
+	/* An older frame still in flight was skipped by the caller */
+	other = slot == &gpu->slots[0] ? &gpu->slots[1] : &gpu->slots[0];
+	if (other->data && other->seq < slot->seq)
+		retire(other);
+
+	err |= ARG(gpu->shrink, 0, slot->frame);
+	err |= ARG(gpu->shrink, 1, step);
+	err |= ARG(gpu->shrink, 2, img);
+	err |= ARG(gpu->shrink, 3, x0);
+	err |= ARG(gpu->shrink, 4, y0);
+	err |= ARG(gpu->shrink, 5, scale);
+	err |= run(gpu, gpu->shrink, size.width, size.height,
+		   &slot->uploaded);
+
+	if (skin->type == SKIN_MODEL_HSV) {
+		err |= blur(gpu, &img, &img_tmp, size);
+		if (gpu->conf.median) {
+			k = gpu->conf.median;
+			err |= ARG(gpu->median, 0, img);
+			err |= ARG(gpu->median, 1, img_tmp);
+			err |= ARG(gpu->median, 2, k);
+			err |= run(gpu, gpu->median, size.width, size.height,
+				   NULL);
+			tmp = img;
+			img = img_tmp;
+			img_tmp = tmp;
+		}
+
+		err |= ARG(gpu->classify_hsv, 0, img);
+		err |= ARG(gpu->classify_hsv, 1, m);
+		err |= ARG(gpu->classify_hsv, 2, gpu->table);
+		err |= ARG(gpu->classify_hsv, 3, skin->hsv.v_min);
+		err |= ARG(gpu->classify_hsv, 4, skin->hsv.v_max);
+		err |= run(gpu, gpu->classify_hsv, size.width, size.height,
+			   NULL);
+	} else {
+		/* Raw pixels are classified, noise is removed from the mask */
+		shift = 8 - SKIN_LUT_BITS;
+		err |= ARG(gpu->classify_lut, 0, img);
+		err |= ARG(gpu->classify_lut, 1, m);
+		err |= ARG(gpu->classify_lut, 2, gpu->table);
+		err |= ARG(gpu->classify_lut, 3, shift);
+		err |= run(gpu, gpu->classify_lut, size.width, size.height,
+			   NULL);
+
+		if (gpu->conf.median) {
+			k = gpu->conf.median;
+			err |= ARG(gpu->vote, 0, m);
+			err |= ARG(gpu->vote, 1, m_tmp);
+			err |= ARG(gpu->vote, 2, k);
+			err |= run(gpu, gpu->vote, size.width, size.height,
+				   NULL);
+			tmp = m;
+			m = m_tmp;
+			m_tmp = tmp;
+		}
+	}
+
+	/* Opening, then the 3x3 dilation of the CPU path */
+	err |= morph(gpu, &m, &m_tmp, size, gpu->conf.morph_radius, 1);
+	err |= morph(gpu, &m, &m_tmp, size, gpu->conf.morph_radius, 0);
+	err |= morph(gpu, &m, &m_tmp, size, 1, 0);
+
+	err |= ARG(gpu->pack, 0, m);
+	err |= ARG(gpu->pack, 1, gpu->bits);
+	err |= ARG(gpu->pack, 2, width);
+	err |= run(gpu, gpu->pack, gpu->words, size.height, NULL);
+
+	/* Only the packed mask comes back */
+	err |= clEnqueueReadBuffer(gpu->queue, gpu->bits, CL_TRUE, 0,
+				   (size_t)gpu->words * size.height *
+				   sizeof(uint64_t), mask->bits, 0, NULL,
+				   NULL);
+
+	retire(slot);
+	if (err != CL_SUCCESS)
+		return -1;
+
+	mask->width = size.width;
+	mask->height = size.height;
+	return 0;
+}
+
+/*
+ * Switch to another model of the same type. The tables are written in
+ * order with the kernels, and before returning, so the caller may
+ * reuse the old model right away. Returns -1 on device errors, after
+ * which the device must not be used any more.
+ */
+int gpu_set_skin(struct gpu *gpu, const struct skin_model *skin)
+{
+	short table[1024];
+	const void *data;
+	size_t size;
+
+	if (skin == gpu->conf.skin)
+		return 0;
+	if (skin->type != gpu->conf.skin->type)
+		return -1;
+
+	data = skin_table(skin, table, &size);
+	if (clEnqueueWriteBuffer(gpu->queue, gpu->table, CL_TRUE, 0, size,
+				 data, 0, NULL, NULL) != CL_SUCCESS)
+		return -1;
+
+	gpu->conf.skin = skin;
+	return 0;
+}
+
+void gpu_release(struct gpu *gpu)
+{
+	cl_kernel kernels[] = {
+		gpu->shrink, gpu->smooth, gpu->median, gpu->classify_hsv,
+		gpu->classify_lut, gpu->vote, gpu->morph, gpu->pack,
+	};
+	cl_mem mems[] = {
+		gpu->slots[0].frame, gpu->slots[1].frame, gpu->img[0],
+		gpu->img[1], gpu->mask[0], gpu->mask[1], gpu->bits,
+		gpu->weights, gpu->table,
+	};
+	unsigned int i;
+
+	if (gpu->queue)
+		clFinish(gpu->queue);
+	retire(&gpu->slots[0]);
+	retire(&gpu->slots[1]);
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+		if (kernels[i])
+			clReleaseKernel(kernels[i]);
+	for (i = 0; i < sizeof(mems) / sizeof(mems[0]); i++)
+		if (mems[i])
+			clReleaseMemObject(mems[i]);
+
+	if (gpu->program)
+		clReleaseProgram(gpu->program);
+	if (gpu->upload_q)
+		clReleaseCommandQueue(gpu->upload_q);
+	if (gpu->queue)
+		clReleaseCommandQueue(gpu->queue);
+	if (gpu->context)
+		clReleaseContext(gpu->context);
+	free(gpu);
+}
+
+#endif
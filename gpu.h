@@ -0,0 +1,84 @@
+/*
+ * OpenCL segmentation backend
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef GPU_H
+#define GPU_H
+
+#include <opencv2/core/core_c.h>
+
+#include "mask.h"
+#include "skin.h"
+
+/*
+ * Segmentation on an OpenCL device: the frame is uploaded once, then
+ * downsampling, smoothing, skin classification and the mask opening run
+ * on the device, and only the final packed mask is read back. Build with
+ * -DENABLE_OPENCL (make OPENCL=1) to enable it: otherwise gpu_init()
+ * always fails and callers keep using the CPU.
+ *
+ * Frames are uploaded into one of two device buffers on a queue of
+ * their own, so the next frame can be sent with gpu_upload() while the
+ * current one is processed. The host image must not change until
+ * gpu_segment() has returned for it.
+ */
+struct gpu;
+
+struct gpu_config {
+	CvSize		size;		/* Of the captured frames */
+	int		scale;		/* Downsampling factor */
+	const struct skin_model *skin;
+	int		smooth;		/* Aperture of the colour blur */
+	int		gaussian;	/* Gaussian instead of box blur */
+	int		median;		/* Aperture of the median, or 0 */
+	int		morph_radius;	/* Of the square opening kernel */
+};
+
+#if defined(ENABLE_OPENCL)
+
+struct gpu *gpu_init(const struct gpu_config *conf);
+void gpu_upload(struct gpu *gpu, const IplImage *image);
+int gpu_segment(struct gpu *gpu, const IplImage *image, CvRect roi,
+		struct bitmask *mask);
+int gpu_set_skin(struct gpu *gpu, const struct skin_model *skin);
+void gpu_release(struct gpu *gpu);
+
+#else
+
+static inline struct gpu *gpu_init(const struct gpu_config *conf)
+{
+	return NULL;
+}
+
+static inline void gpu_upload(struct gpu *gpu, const IplImage *image) { }
+
+static inline int gpu_segment(struct gpu *gpu, const IplImage *image,
+			      CvRect roi, struct bitmask *mask)
+{
+	return -1;
+}
+
+static inline int gpu_set_skin(struct gpu *gpu,
+			       const struct skin_model *skin)
+{
+	return -1;
+}
+
+static inline void gpu_release(struct gpu *gpu) { }
+
+#endif
+
+#endif
@@ -15,15 +15,48 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <opencv2/imgproc/imgproc_c.h>
 #include <opencv2/highgui/highgui_c.h>
 
+#include "batch.h"
+#include "detector.h"
+#include "recorder.h"
+#include "result.h"
+#include "ring.h"
+#include "sink.h"
+#include "skin.h"
+#include "source.h"
+#include "stats.h"
+
+#define VIDEO_SOURCE	"0"
 #define VIDEO_FILE	"video.avi"
-#define VIDEO_FORMAT	CV_FOURCC('M', 'J', 'P', 'G')
-#define NUM_FINGERS	5
-#define NUM_DEFECTS	8
+#define STREAM_FILE	"video-%d.avi"	/* Recording of each stream */
+#define VIDEO_CODEC	"MJPG"		/* Default and fallback codec */
+
+/* Default depth of the queues between pipeline stages */
+#define PIPELINE_DEPTH		4
+/* Sleep time of a pipeline stage waiting on a queue */
+#define PIPELINE_POLL_US	500
+
+/*
+ * Frames of the latest-frame mode: one being grabbed, one waiting in the
+ * mailbox and one being processed
+ */
+#define LATEST_FRAMES		3
+
+/* Default allowed throughput regression in benchmarks, in percent */
+#define BENCH_THRESHOLD		10
 
 #define RED     CV_RGB(255, 0, 0)
 #define GREEN   CV_RGB(0, 255, 0)
@@ -33,61 +66,295 @@
 #define GREY    CV_RGB(200, 200, 200)
 
 struct ctx {
-	CvCapture	*capture;	/* Capture handle */
-	CvVideoWriter	*writer;	/* File recording handle */
+	const char	*source;	/* Camera index, file name or URL */
+	struct source	*capture;	/* Frame source */
+	struct source_frame frame;	/* Frame held from the source */
+	IplImage	header;		/* Describes the held frame */
+	char		video_file[32];
+	struct recorder	*recorder;	/* File recording, if any */
+	const char	*codec;		/* FOURCC of the recording */
+	int		preroll;	/* Record only around detections */
 
 	IplImage	*image;		/* Input image */
-	IplImage	*thr_image;	/* After filtering and thresholding */
-	IplImage	*temp_image1;	/* Temporary image (1 channel) */
-	IplImage	*temp_image3;	/* Temporary image (3 channels) */
+	struct hand_config conf;	/* Detector settings */
+	struct hand_detector *det;
+
+	IplImage	*out_image;	/* Input image with overlay */
+	uint64_t	timestamp;	/* Capture time of image, in us */
+	int		stream;		/* Index of the source */
+	struct sink	*sink;		/* Results output, if any */
 
-	CvSeq		*contour;	/* Hand contour */
-	CvSeq		*hull;		/* Hand convex hull */
+	int		latest;		/* Process only the newest frame */
+	int		pipeline;	/* Run stages on separate threads */
+	int		pipeline_depth;
+	enum ring_policy pipeline_policy;
 
-	CvPoint		hand_center;
-	CvPoint		*fingers;	/* Detected fingers positions */
-	CvPoint		*defects;	/* Convexity defects depth points */
+	int		num_workers;	/* Threads shared by all streams */
+	unsigned long	num_frames;	/* Frames processed so far */
+	unsigned long	max_frames;	/* Stop after that many, 0 for never */
+
+	int		headless;	/* No windows and no key polling */
+	int		record;		/* Write output to video_file */
+};
+
+/* Set on SIGINT or SIGTERM, makes all the processing loops exit */
+static volatile sig_atomic_t quit;
+
+/* Preallocated frame travelling through the pipeline stages */
+struct frame {
+	IplImage	*image;		/* Copy of the captured frame */
+	IplImage	*mask;		/* Copy of the thresholded image */
+	uint64_t	timestamp;
+	int		num_hands;
+	struct hand_result hands[MAX_HANDS];
+};
 
-	CvMemStorage	*hull_st;
-	CvMemStorage	*contour_st;
-	CvMemStorage	*temp_st;
-	CvMemStorage	*defects_st;
+/*
+ * Capture, detection and render/record run on their own thread and
+ * exchange frames through SPSC rings. Frames are never allocated after
+ * startup: the render stage gives them back to capture through free_q,
+ * and frames evicted from render_q by the detection stage go back
+ * through drop_q, so that every ring keeps a single producer.
+ */
+struct pipeline {
+	struct ctx	*ctx;
+
+	struct frame	*frames;
+	int		num_frames;
+
+	struct ring	capture_q;	/* Capture -> detection */
+	struct ring	render_q;	/* Detection -> render */
+	struct ring	free_q;		/* Render -> capture */
+	struct ring	drop_q;		/* Detection -> capture */
+
+	pthread_t	capture_thread;
+	pthread_t	detect_thread;
+
+	atomic_int	stop;		/* Stop capturing new frames */
+	atomic_int	capture_done;
+	atomic_int	detect_done;
+};
+
+/*
+ * In latest-frame mode a grab thread drains the source as fast as it
+ * delivers, posting every frame to a mailbox where it replaces the one
+ * not yet taken. The main thread always processes the newest frame, so
+ * a slow detector drops frames instead of lagging behind the camera.
+ */
+struct latest {
+	struct ctx	*ctx;
 
-	IplConvKernel	*kernel;	/* Kernel for morph operations */
+	struct frame	frames[LATEST_FRAMES];
+	struct mailbox	mailbox;	/* Grab -> main */
+	struct ring	free_q;		/* Main -> grab */
 
-	int		num_fingers;
-	int		hand_radius;
-	int		num_defects;
+	pthread_t	thread;
+	atomic_int	stop;
+	atomic_int	done;
 };
 
+/* Camera indices and scales are made only of digits */
+static int is_camera(const char *source)
+{
+	for (; *source; source++)
+		if (!isdigit((unsigned char)*source))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * A source may end with #N to override the detection scale for that
+ * stream only, eg. "1#4" processes camera 1 at quarter resolution.
+ */
+void set_source(struct ctx *ctx, char *source)
+{
+	char *suffix = strrchr(source, '#');
+	int scale;
+
+	ctx->source = source;
+
+	if (!suffix || !suffix[1] || !is_camera(suffix + 1))
+		return;
+
+	scale = atoi(suffix + 1);
+	if (scale < 1 || scale > MAX_SCALE) {
+		fprintf(stderr, "Invalid scale for %s\n", source);
+		exit(1);
+	}
+
+	ctx->conf.scale = scale;
+	*suffix = '\0';
+}
+
+/* Wall clock time in microseconds, for results timestamps */
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Give the previous frame back to the source and get the next one,
+ * which is described by ctx->header without copying. NULL at the end of
+ * the stream.
+ */
+static IplImage *next_frame(struct ctx *ctx)
+{
+	struct source_frame *frame = &ctx->frame;
+
+	source_release(frame);
+	if (source_next(ctx->capture, frame) < 0)
+		return NULL;
+
+	if (!frame->timestamp)
+		frame->timestamp = now_us();
+
+	cvInitImageHeader(&ctx->header, cvSize(frame->image.width,
+					       frame->image.height),
+			  8, 3, 0, 4);
+	cvSetData(&ctx->header, frame->image.data, frame->image.stride);
+	return &ctx->header;
+}
+
 void init_capture(struct ctx *ctx)
 {
-	ctx->capture = cvCaptureFromCAM(0);
+	ctx->capture = source_open(ctx->source);
 	if (!ctx->capture) {
-		fprintf(stderr, "Error initializing capture\n");
+		fprintf(stderr, "Error initializing capture from %s\n",
+			ctx->source);
 		exit(1);
 	}
-	ctx->image = cvQueryFrame(ctx->capture);
+	ctx->image = next_frame(ctx);
 }
 
+/* Create the detector for the size of the first captured frame */
+void init_detector(struct ctx *ctx)
+{
+	struct hand_stats stats;
+	int ret;
+
+	if (!ctx->image) {
+		fprintf(stderr, "No frames from %s\n", ctx->source);
+		exit(1);
+	}
+
+	/* The thresholded image is only shown in the windows */
+	ctx->conf.keep_mask = !ctx->headless;
+
+	ret = hand_detector_create(&ctx->det, &ctx->conf, ctx->image->width,
+				   ctx->image->height);
+	if (ret < 0) {
+		fprintf(stderr, "Error initializing detector: %s\n",
+			hand_strerror(ret));
+		exit(1);
+	}
+
+	if (!ctx->headless || ctx->record)
+		ctx->out_image = cvCreateImage(cvGetSize(ctx->image), 8, 3);
+
+	hand_detector_stats(ctx->det, &stats);
+	if (ctx->conf.use_gpu && !stats.gpu)
+		fprintf(stderr, "No OpenCL GPU available, segmenting on the CPU\n");
+}
+
+void release_detector(struct ctx *ctx)
+{
+	hand_detector_destroy(ctx->det);
+	ctx->det = NULL;
+	cvReleaseImage(&ctx->out_image);
+	source_release(&ctx->frame);
+	source_close(ctx->capture);
+	ctx->capture = NULL;
+}
+
+/* Describe a captured image to the detector, which reads it in place */
+static void frame_from_image(struct hand_frame *frame, const IplImage *image)
+{
+	frame->data = (unsigned char *)image->imageData;
+	frame->width = image->width;
+	frame->height = image->height;
+	frame->stride = image->widthStep;
+}
+
+/* Detect on ctx->image, results stay valid until the next call */
+static void detect(struct ctx *ctx)
+{
+	struct hand_frame frame;
+
+	frame_from_image(&frame, ctx->image);
+	if (hand_detector_process(ctx->det, &frame) < 0)
+		fprintf(stderr, "Frame %lu rejected by the detector\n",
+			ctx->num_frames);
+}
+
+static void handle_signal(int sig)
+{
+	quit = 1;
+}
+
+/* Return the FOURCC code of a codec name, such as MJPG or H264 */
+static int fourcc(const char *codec)
+{
+	char c[4] = { ' ', ' ', ' ', ' ' };
+
+	memcpy(c, codec, MIN(strlen(codec), 4));
+	return CV_FOURCC(c[0], c[1], c[2], c[3]);
+}
+
+/*
+ * The encoder behind a FOURCC is chosen by the OpenCV video backend,
+ * which may use a hardware H.264 encoder if it was built with one. A
+ * codec the backend does not have falls back to VIDEO_CODEC.
+ */
 void init_recording(struct ctx *ctx)
 {
 	int fps, width, height;
+	CvSize size;
 
-	fps = cvGetCaptureProperty(ctx->capture, CV_CAP_PROP_FPS);
-	width = cvGetCaptureProperty(ctx->capture, CV_CAP_PROP_FRAME_WIDTH);
-	height = cvGetCaptureProperty(ctx->capture, CV_CAP_PROP_FRAME_HEIGHT);
+	fps = ctx->capture->fps;
+	width = ctx->capture->width;
+	height = ctx->capture->height;
+	size = cvSize(width, height);
 
-	if (fps < 0)
+	if (fps <= 0)
 		fps = 10;
+	if (!ctx->codec)
+		ctx->codec = VIDEO_CODEC;
 
-	ctx->writer = cvCreateVideoWriter(VIDEO_FILE, VIDEO_FORMAT, fps,
-					  cvSize(width, height), 1);
-
-	if (!ctx->writer) {
-		fprintf(stderr, "Error initializing video writer\n");
+	ctx->recorder = malloc(sizeof(*ctx->recorder));
+	if (!ctx->recorder) {
+		fprintf(stderr, "Error allocating video writer\n");
 		exit(1);
 	}
+
+	if (!recorder_open(ctx->recorder, ctx->video_file, fourcc(ctx->codec),
+			   fps, size, ctx->preroll))
+		return;
+
+	if (strcmp(ctx->codec, VIDEO_CODEC)) {
+		fprintf(stderr, "Codec %s not available, using %s\n",
+			ctx->codec, VIDEO_CODEC);
+		if (!recorder_open(ctx->recorder, ctx->video_file,
+				   fourcc(VIDEO_CODEC), fps, size, ctx->preroll))
+			return;
+	}
+
+	fprintf(stderr, "Error initializing video writer\n");
+	exit(1);
+}
+
+/* Flush the recording, so that it is usable after a signal */
+void stop_recording(struct ctx *ctx)
+{
+	if (!ctx->recorder)
+		return;
+
+	recorder_close(ctx->recorder);
+	free(ctx->recorder);
+	ctx->recorder = NULL;
 }
 
 void init_windows(void)
@@ -98,233 +365,1135 @@ void init_windows(void)
 	cvMoveWindow("thresholded", 700, 50);
 }
 
-void init_ctx(struct ctx *ctx)
+/* Detection made a hull, so there is a hand in the result */
+static int hand_found(const struct hand_result *hand)
 {
-	ctx->thr_image = cvCreateImage(cvGetSize(ctx->image), 8, 1);
-	ctx->temp_image1 = cvCreateImage(cvGetSize(ctx->image), 8, 1);
-	ctx->temp_image3 = cvCreateImage(cvGetSize(ctx->image), 8, 3);
-	ctx->kernel = cvCreateStructuringElementEx(9, 9, 4, 4, CV_SHAPE_RECT,
-						   NULL);
-	ctx->contour_st = cvCreateMemStorage(0);
-	ctx->hull_st = cvCreateMemStorage(0);
-	ctx->temp_st = cvCreateMemStorage(0);
-	ctx->fingers = calloc(NUM_FINGERS + 1, sizeof(CvPoint));
-	ctx->defects = calloc(NUM_DEFECTS, sizeof(CvPoint));
+	return hand->num_defects > 0;
 }
 
-void filter_and_threshold(struct ctx *ctx)
+/* The largest hand comes first, so it is found if any is */
+static int detector_found(const struct hand_detector *det)
 {
+	return hand_found(hand_detector_result(det, 0));
+}
+
+/*
+ * Send the results of the current frame to the results output, one
+ * record per hand. The first is sent even without a hand, so that every
+ * frame shows up.
+ */
+void publish(struct ctx *ctx)
+{
+	int i, n = MAX(hand_detector_num_hands(ctx->det), 1);
+
+	for (i = 0; ctx->sink && i < n; i++)
+		sink_write(ctx->sink, ctx->stream, ctx->num_frames,
+			   ctx->timestamp, i, hand_detector_result(ctx->det, i));
+}
+
+/* Draw a detection result over an image, whatever its finger count */
+void draw_result(IplImage *image, const struct hand_result *hand,
+		 CvSeq *contour)
+{
+	int i;
+
+	if (hand_found(hand)) {
+
+#if defined(SHOW_HAND_CONTOUR)
+		if (contour)
+			cvDrawContours(image, contour, BLUE, GREEN, 0, 1,
+				       CV_AA, cvPoint(0, 0));
+#endif
+		cvCircle(image, hand->center, 5, PURPLE, 1, CV_AA, 0);
+		cvCircle(image, hand->center, hand->radius, RED, 1, CV_AA, 0);
+
+		for (i = 0; i < hand->num_fingers; i++) {
+
+			cvCircle(image, hand->fingers[i], 10,
+				 GREEN, 3, CV_AA, 0);
+
+			cvLine(image, hand->center, hand->fingers[i],
+			       YELLOW, 1, CV_AA, 0);
+		}
+
+		for (i = 0; i < hand->num_defects; i++) {
+			cvCircle(image, hand->defects[i], 2,
+				 GREY, 2, CV_AA, 0);
+		}
+	}
+}
+
+/*
+ * Composite the overlay on the output buffer. The input image belongs to
+ * the capture and is never written.
+ */
+void render(struct ctx *ctx)
+{
+	int i;
+
+	cvCopy(ctx->image, ctx->out_image, NULL);
+	for (i = 0; i < hand_detector_num_hands(ctx->det); i++)
+		draw_result(ctx->out_image, hand_detector_result(ctx->det, i),
+			    hand_detector_contour(ctx->det, i));
+}
 
-	/* Soften image */
-	cvSmooth(ctx->image, ctx->temp_image3, CV_GAUSSIAN, 11, 11, 0, 0);
-	/* Remove some impulsive noise */
-	cvSmooth(ctx->temp_image3, ctx->temp_image3, CV_MEDIAN, 11, 11, 0, 0);
+void display(struct ctx *ctx)
+{
+	/* The overlay is only needed by windows and recordings */
+	if (!ctx->headless || ctx->recorder)
+		render(ctx);
 
-	cvCvtColor(ctx->temp_image3, ctx->temp_image3, CV_BGR2HSV);
+	if (ctx->headless)
+		return;
 
-	/*
-	 * Apply threshold on HSV values to detect skin color
-	 */
-	cvInRangeS(ctx->temp_image3,
-		   cvScalar(0, 55, 90, 255),
-		   cvScalar(28, 175, 230, 255),
-		   ctx->thr_image);
+	cvShowImage("output", ctx->out_image);
+	cvShowImage("thresholded", hand_detector_mask(ctx->det));
+}
 
-	/* Apply morphological opening */
-	cvMorphologyEx(ctx->thr_image, ctx->thr_image, NULL, ctx->kernel,
-		       CV_MOP_OPEN, 1);
-	cvSmooth(ctx->thr_image, ctx->thr_image, CV_GAUSSIAN, 3, 3, 0, 0);
+static void pipeline_wait(void)
+{
+	usleep(PIPELINE_POLL_US);
 }
 
-void find_contour(struct ctx *ctx)
+/* Push a frame to a blocking ring, giving up if the pipeline stops */
+static void pipeline_push(struct pipeline *p, struct ring *r,
+			  struct frame *frame, struct frame **evicted)
 {
-	double area, max_area = 0.0;
-	CvSeq *contours, *tmp, *contour = NULL;
+	void *old;
 
-	/* cvFindContours modifies input image, so make a copy */
-	cvCopy(ctx->thr_image, ctx->temp_image1, NULL);
-	cvFindContours(ctx->temp_image1, ctx->temp_st, &contours,
-		       sizeof(CvContour), CV_RETR_EXTERNAL,
-		       CV_CHAIN_APPROX_SIMPLE, cvPoint(0, 0));
+	while (ring_push(r, frame, &old) < 0) {
+		if (atomic_load(&p->stop))
+			break;
+		pipeline_wait();
+	}
 
-	/* Select contour having greatest area */
-	for (tmp = contours; tmp; tmp = tmp->h_next) {
-		area = fabs(cvContourArea(tmp, CV_WHOLE_SEQ, 0));
-		if (area > max_area) {
-			max_area = area;
-			contour = tmp;
+	if (old)
+		STATS_DROP(1);
+	*evicted = old;
+}
+
+void *capture_thread(void *arg)
+{
+	struct pipeline *p = arg;
+	struct frame *frame = NULL, *evicted;
+	unsigned long count = 0;
+	IplImage *image;
+
+	while (!atomic_load(&p->stop) && !quit) {
+		if (p->ctx->max_frames && count >= p->ctx->max_frames)
+			break;
+
+		if (!frame)
+			frame = ring_pop(&p->free_q);
+		if (!frame)
+			frame = ring_pop(&p->drop_q);
+		if (!frame) {
+			/* All frames in flight */
+			pipeline_wait();
+			continue;
 		}
+
+		/* Kept past the source buffer's life and drawn on */
+		image = next_frame(p->ctx);
+		if (!image)
+			break;
+		frame->timestamp = p->ctx->frame.timestamp;
+		cvCopy(image, frame->image, NULL);
+
+		pipeline_push(p, &p->capture_q, frame, &evicted);
+		frame = evicted;
+		count++;
 	}
 
-	/* Approximate contour with poly-line */
-	if (contour) {
-		contour = cvApproxPoly(contour, sizeof(CvContour),
-				       ctx->contour_st, CV_POLY_APPROX_DP, 2,
-				       1);
-		ctx->contour = contour;
+	atomic_store(&p->capture_done, 1);
+	return NULL;
+}
+
+void *detect_thread(void *arg)
+{
+	struct pipeline *p = arg;
+	struct ctx *ctx = p->ctx;
+	struct frame *frame, *next = NULL, *evicted;
+	int i;
+
+	for (;;) {
+		frame = next ? next : ring_pop(&p->capture_q);
+		next = NULL;
+		if (!frame) {
+			if (atomic_load(&p->capture_done) &&
+			    !(frame = ring_pop(&p->capture_q)))
+				break;
+			if (!frame) {
+				pipeline_wait();
+				continue;
+			}
+		}
+
+		/* Send the next frame to the device while this one runs */
+		if ((next = ring_pop(&p->capture_q))) {
+			struct hand_frame ahead;
+
+			frame_from_image(&ahead, next->image);
+			hand_detector_prefetch(ctx->det, &ahead);
+		}
+
+		ctx->image = frame->image;
+		ctx->timestamp = frame->timestamp;
+
+		STATS_TIME(STAGE_FRAME, detect(ctx));
+		publish(ctx);
+		ctx->num_frames++;
+		frame->num_hands = hand_detector_num_hands(ctx->det);
+		for (i = 0; i < MAX(frame->num_hands, 1); i++)
+			frame->hands[i] = *hand_detector_result(ctx->det, i);
+		if (frame->mask)
+			cvCopy(hand_detector_mask(ctx->det), frame->mask, NULL);
+
+		pipeline_push(p, &p->render_q, frame, &evicted);
+		if (evicted)
+			ring_push(&p->drop_q, evicted, NULL);
 	}
+
+	atomic_store(&p->detect_done, 1);
+	return NULL;
 }
 
-void find_convex_hull(struct ctx *ctx)
+static void render_frame(struct ctx *ctx, struct frame *frame)
 {
-	CvSeq *defects;
-	CvConvexityDefect *defect_array;
 	int i;
-	int x = 0, y = 0;
-	int dist = 0;
 
-	ctx->hull = NULL;
+	/* The frame belongs to the pipeline, draw in place */
+	for (i = 0; (!ctx->headless || ctx->recorder) &&
+		    i < frame->num_hands; i++)
+		draw_result(frame->image, &frame->hands[i], NULL);
 
-	if (!ctx->contour)
-		return;
+	if (frame->mask) {
+		cvShowImage("output", frame->image);
+		cvShowImage("thresholded", frame->mask);
+	}
+}
 
-	ctx->hull = cvConvexHull2(ctx->contour, ctx->hull_st, CV_CLOCKWISE, 0);
+static void print_ring_stats(const char *name, const struct ring *r)
+{
+	fprintf(stderr, "%-8s pushed %lu dropped %lu depth avg %.2f max %lu\n",
+		name, r->pushed, r->dropped,
+		r->pushed ? (double)r->depth_sum / r->pushed : 0.0,
+		r->depth_max);
+}
+
+/*
+ * Run capture and detection on their own threads, while the calling
+ * thread shows and records the results so that all highgui calls stay
+ * on the thread that created the windows.
+ */
+void run_pipeline(struct ctx *ctx)
+{
+	struct pipeline p = { .ctx = ctx };
+	struct frame *frame;
+	const IplImage *mask = hand_detector_mask(ctx->det);
+	CvSize size = cvGetSize(ctx->image);
+	int i;
 
-	if (ctx->hull) {
+	/* One frame for each queue slot, plus one owned by each stage */
+	p.num_frames = 2 * ctx->pipeline_depth + 3;
+	p.frames = calloc(p.num_frames, sizeof(*p.frames));
+
+	if (!p.frames ||
+	    ring_init(&p.capture_q, ctx->pipeline_depth,
+		      ctx->pipeline_policy) < 0 ||
+	    ring_init(&p.render_q, ctx->pipeline_depth,
+		      ctx->pipeline_policy) < 0 ||
+	    ring_init(&p.free_q, p.num_frames, RING_BLOCK) < 0 ||
+	    ring_init(&p.drop_q, p.num_frames, RING_BLOCK) < 0) {
+		fprintf(stderr, "Error initializing pipeline\n");
+		exit(1);
+	}
 
-		/* Get convexity defects of contour w.r.t. the convex hull */
-		defects = cvConvexityDefects(ctx->contour, ctx->hull,
-					     ctx->defects_st);
+	for (i = 0; i < p.num_frames; i++) {
+		p.frames[i].image = cvCreateImage(size, 8, 3);
+		if (mask)
+			p.frames[i].mask = cvCreateImage(cvGetSize(mask), 8, 1);
+		ring_push(&p.free_q, &p.frames[i], NULL);
+	}
 
-		if (defects && defects->total) {
-			defect_array = calloc(defects->total,
-					      sizeof(CvConvexityDefect));
-			cvCvtSeqToArray(defects, defect_array, CV_WHOLE_SEQ);
+	atomic_init(&p.stop, 0);
+	atomic_init(&p.capture_done, 0);
+	atomic_init(&p.detect_done, 0);
 
-			/* Average depth points to get hand center */
-			for (i = 0; i < defects->total && i < NUM_DEFECTS; i++) {
-				x += defect_array[i].depth_point->x;
-				y += defect_array[i].depth_point->y;
+	if (pthread_create(&p.capture_thread, NULL, capture_thread, &p) ||
+	    pthread_create(&p.detect_thread, NULL, detect_thread, &p)) {
+		fprintf(stderr, "Error creating pipeline threads\n");
+		exit(1);
+	}
 
-				ctx->defects[i] = cvPoint(defect_array[i].depth_point->x,
-							  defect_array[i].depth_point->y);
+	for (;;) {
+		frame = ring_pop(&p.render_q);
+		if (!frame) {
+			if (atomic_load(&p.detect_done) &&
+			    !(frame = ring_pop(&p.render_q)))
+				break;
+			if (!frame) {
+				pipeline_wait();
+				continue;
 			}
+		}
 
-			x /= defects->total;
-			y /= defects->total;
+		STATS_TIME(STAGE_DISPLAY, render_frame(ctx, frame));
+		if (ctx->recorder)
+			recorder_write(ctx->recorder, frame->image,
+				       hand_found(&frame->hands[0]));
 
-			ctx->num_defects = defects->total;
-			ctx->hand_center = cvPoint(x, y);
+		ring_push(&p.free_q, frame, NULL);
 
-			/* Compute hand radius as mean of distances of
-			   defects' depth point to hand center */
-			for (i = 0; i < defects->total; i++) {
-				int d = (x - defect_array[i].depth_point->x) *
-					(x - defect_array[i].depth_point->x) +
-					(y - defect_array[i].depth_point->y) *
-					(y - defect_array[i].depth_point->y);
+		if (!ctx->headless && cvWaitKey(1) == 'q')
+			atomic_store(&p.stop, 1);
+	}
 
-				dist += sqrt(d);
-			}
+	pthread_join(p.capture_thread, NULL);
+	pthread_join(p.detect_thread, NULL);
+
+	print_ring_stats("capture", &p.capture_q);
+	print_ring_stats("render", &p.render_q);
+
+	for (i = 0; i < p.num_frames; i++) {
+		cvReleaseImage(&p.frames[i].image);
+		cvReleaseImage(&p.frames[i].mask);
+	}
+	free(p.frames);
+	ring_free(&p.capture_q);
+	ring_free(&p.render_q);
+	ring_free(&p.free_q);
+	ring_free(&p.drop_q);
+}
 
-			ctx->hand_radius = dist / defects->total;
-			free(defect_array);
+void *grab_thread(void *arg)
+{
+	struct latest *l = arg;
+	struct frame *frame = NULL;
+	IplImage *image;
+
+	while (!atomic_load(&l->stop) && !quit) {
+		if (!frame)
+			frame = ring_pop(&l->free_q);
+		if (!frame) {
+			/* Only while the main thread swaps frames */
+			pipeline_wait();
+			continue;
 		}
+
+		image = next_frame(l->ctx);
+		if (!image)
+			break;
+		frame->timestamp = l->ctx->frame.timestamp;
+		cvCopy(image, frame->image, NULL);
+
+		frame = mailbox_post(&l->mailbox, frame);
+		if (frame)
+			STATS_DROP(1);
 	}
+
+	atomic_store(&l->done, 1);
+	return NULL;
 }
 
-void find_fingers(struct ctx *ctx)
+/* Detect and show the newest frame, until the source ends or 'q' */
+void run_latest(struct ctx *ctx)
 {
-	int n;
+	struct latest l = { .ctx = ctx };
+	struct frame *frame, *prev = NULL;
+	CvSize size = cvGetSize(ctx->image);
 	int i;
-	CvPoint *points;
-	CvPoint max_point;
-	int dist1 = 0, dist2 = 0;
 
-	ctx->num_fingers = 0;
+	mailbox_init(&l.mailbox);
+	if (ring_init(&l.free_q, LATEST_FRAMES, RING_BLOCK) < 0) {
+		fprintf(stderr, "Error initializing frame mailbox\n");
+		exit(1);
+	}
 
-	if (!ctx->contour || !ctx->hull)
-		return;
+	for (i = 0; i < LATEST_FRAMES; i++) {
+		l.frames[i].image = cvCreateImage(size, 8, 3);
+		ring_push(&l.free_q, &l.frames[i], NULL);
+	}
 
-	n = ctx->contour->total;
-	points = calloc(n, sizeof(CvPoint));
+	atomic_init(&l.stop, 0);
+	atomic_init(&l.done, 0);
+
+	if (pthread_create(&l.thread, NULL, grab_thread, &l)) {
+		fprintf(stderr, "Error creating grab thread\n");
+		exit(1);
+	}
 
-	cvCvtSeqToArray(ctx->contour, points, CV_WHOLE_SEQ);
+	while (!quit) {
+		if (ctx->max_frames && ctx->num_frames >= ctx->max_frames)
+			break;
 
-	/*
-	 * Fingers are detected as points where the distance to the center
-	 * is a local maximum
-	 */
-	for (i = 0; i < n; i++) {
-		int dist;
-		int cx = ctx->hand_center.x;
-		int cy = ctx->hand_center.y;
+		frame = mailbox_take(&l.mailbox);
+		if (!frame) {
+			if (atomic_load(&l.done) &&
+			    !(frame = mailbox_take(&l.mailbox)))
+				break;
+			if (!frame) {
+				pipeline_wait();
+				continue;
+			}
+		}
 
-		dist = (cx - points[i].x) * (cx - points[i].x) +
-		    (cy - points[i].y) * (cy - points[i].y);
+		/* The grab thread may need it before this frame is done */
+		if (prev)
+			ring_push(&l.free_q, prev, NULL);
+		prev = frame;
 
-		if (dist < dist1 && dist1 > dist2 && max_point.x != 0
-		    && max_point.y < cvGetSize(ctx->image).height - 10) {
+		ctx->image = frame->image;
+		ctx->timestamp = frame->timestamp;
 
-			ctx->fingers[ctx->num_fingers++] = max_point;
-			if (ctx->num_fingers >= NUM_FINGERS + 1)
-				break;
+		STATS_TIME(STAGE_FRAME, detect(ctx));
+		publish(ctx);
+		STATS_TIME(STAGE_DISPLAY, display(ctx));
+		if (ctx->recorder)
+			recorder_write(ctx->recorder, ctx->out_image,
+				       detector_found(ctx->det));
+
+		ctx->num_frames++;
+
+		if (!ctx->headless && cvWaitKey(1) == 'q')
+			break;
+	}
+
+	atomic_store(&l.stop, 1);
+	pthread_join(l.thread, NULL);
+
+	fprintf(stderr, "Stale frames dropped: %lu of %lu\n", l.mailbox.stale,
+		l.mailbox.posted);
+
+	/* It pointed to one of the frames */
+	ctx->image = NULL;
+	for (i = 0; i < LATEST_FRAMES; i++)
+		cvReleaseImage(&l.frames[i].image);
+	ring_free(&l.free_q);
+}
+
+/*
+ * With several sources each stream has its own context, and a fixed set
+ * of worker threads pinned to cores processes them one frame at a time.
+ * A stream is in at most one run queue, so its frames are processed in
+ * order; workers without streams steal from the back of other queues.
+ */
+struct worker {
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	struct ctx	**queue;	/* Circular queue of runnable streams */
+	int		head;
+	int		count;
+	int		cpu;
+	struct pool	*pool;
+};
+
+struct pool {
+	struct worker	*workers;
+	int		num_workers;
+	int		num_streams;
+	atomic_int	running;	/* Streams not yet finished */
+};
+
+static void worker_push(struct worker *w, struct ctx *ctx)
+{
+	pthread_mutex_lock(&w->lock);
+	w->queue[(w->head + w->count++) % w->pool->num_streams] = ctx;
+	pthread_mutex_unlock(&w->lock);
+}
+
+static struct ctx *worker_pop(struct worker *w, int steal)
+{
+	struct ctx *ctx = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->count) {
+		if (steal) {
+			ctx = w->queue[(w->head + w->count - 1) %
+				       w->pool->num_streams];
+		} else {
+			ctx = w->queue[w->head];
+			w->head = (w->head + 1) % w->pool->num_streams;
+		}
+		w->count--;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return ctx;
+}
+
+static struct ctx *worker_next(struct worker *w)
+{
+	struct pool *pool = w->pool;
+	struct ctx *ctx;
+	int i, victim;
+
+	ctx = worker_pop(w, 0);
+
+	for (i = 1; !ctx && i < pool->num_workers; i++) {
+		victim = (w - pool->workers + i) % pool->num_workers;
+		ctx = worker_pop(&pool->workers[victim], 1);
+	}
+
+	return ctx;
+}
+
+void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct ctx *ctx;
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(w->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	while (!quit && atomic_load(&w->pool->running)) {
+		ctx = worker_next(w);
+		if (!ctx) {
+			usleep(PIPELINE_POLL_US);
+			continue;
 		}
 
-		dist2 = dist1;
-		dist1 = dist;
-		max_point = points[i];
+		if (ctx->max_frames && ctx->num_frames >= ctx->max_frames)
+			ctx->image = NULL;
+		else
+			ctx->image = next_frame(ctx);
+		if (!ctx->image) {
+			atomic_fetch_sub(&w->pool->running, 1);
+			continue;
+		}
+		ctx->timestamp = ctx->frame.timestamp;
+
+		STATS_TIME(STAGE_FRAME, detect(ctx));
+		publish(ctx);
+		if (ctx->recorder) {
+			STATS_TIME(STAGE_DISPLAY, render(ctx));
+			recorder_write(ctx->recorder, ctx->out_image,
+				       detector_found(ctx->det));
+		}
+		ctx->num_frames++;
+
+		worker_push(w, ctx);
 	}
 
-	free(points);
+	return NULL;
 }
 
-void display(struct ctx *ctx)
+/* Process several sources in one process, until all end or SIGINT */
+void run_streams(struct ctx *conf, char **sources, int num_streams)
 {
+	struct pool pool = { .num_streams = num_streams };
+	struct ctx *streams;
+	int64_t start;
+	double secs;
+	int i, ncpu;
+
+	streams = calloc(num_streams, sizeof(*streams));
+	if (!streams) {
+		fprintf(stderr, "Error allocating streams\n");
+		exit(1);
+	}
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+	pool.num_workers = conf->num_workers ? conf->num_workers : ncpu;
+	if (pool.num_workers > num_streams)
+		pool.num_workers = num_streams;
+
+	pool.workers = calloc(pool.num_workers, sizeof(*pool.workers));
+	if (!pool.workers) {
+		fprintf(stderr, "Error allocating workers\n");
+		exit(1);
+	}
+
+	for (i = 0; i < pool.num_workers; i++) {
+		struct worker *w = &pool.workers[i];
+
+		w->queue = calloc(num_streams, sizeof(*w->queue));
+		if (!w->queue) {
+			fprintf(stderr, "Error allocating workers\n");
+			exit(1);
+		}
+		pthread_mutex_init(&w->lock, NULL);
+		w->cpu = i % ncpu;
+		w->pool = &pool;
+	}
+
+	for (i = 0; i < num_streams; i++) {
+		struct ctx *ctx = &streams[i];
+
+		*ctx = *conf;
+		set_source(ctx, sources[i]);
+		ctx->stream = i;
+		/* Streams never show windows, only recordings need drawing */
+		ctx->headless = 1;
+		snprintf(ctx->video_file, sizeof(ctx->video_file),
+			 STREAM_FILE, i);
+
+		init_capture(ctx);
+		if (ctx->record)
+			init_recording(ctx);
+		init_detector(ctx);
+
+		worker_push(&pool.workers[i % pool.num_workers], ctx);
+	}
+	atomic_init(&pool.running, num_streams);
+
+	start = cvGetTickCount();
+
+	for (i = 0; i < pool.num_workers; i++) {
+		if (pthread_create(&pool.workers[i].thread, NULL,
+				   worker_thread, &pool.workers[i])) {
+			fprintf(stderr, "Error creating worker threads\n");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < pool.num_workers; i++)
+		pthread_join(pool.workers[i].thread, NULL);
+
+	secs = (cvGetTickCount() - start) / (cvGetTickFrequency() * 1e6);
+
+	for (i = 0; i < num_streams; i++) {
+		struct hand_stats stats;
+
+		hand_detector_stats(streams[i].det, &stats);
+		fprintf(stderr, "%s: %lu frames, %.1f fps, peak storage "
+			"%zu bytes, %lu skipped\n", streams[i].source,
+			streams[i].num_frames,
+			secs > 0 ? streams[i].num_frames / secs : 0.0,
+			stats.storage_peak, stats.idle_frames);
+		stop_recording(&streams[i]);
+		release_detector(&streams[i]);
+	}
+
+	for (i = 0; i < pool.num_workers; i++) {
+		pthread_mutex_destroy(&pool.workers[i].lock);
+		free(pool.workers[i].queue);
+	}
+	free(pool.workers);
+	free(streams);
+}
+
+static int read_baseline(const char *path, double *fps)
+{
+	FILE *f;
+	int ret;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	ret = fscanf(f, "%lf", fps) == 1 ? 0 : -1;
+	fclose(f);
+	return ret;
+}
+
+static int write_baseline(const char *path, double fps)
+{
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+
+	if (fprintf(f, "%.2f\n", fps) < 0)
+		ret = -1;
+	if (fclose(f))
+		ret = -1;
+	return ret;
+}
+
+/*
+ * Replay recorded clips one after another as fast as possible, without
+ * windows or recording, and report the throughput. If a baseline file
+ * is given, fail when throughput is more than threshold percent below
+ * it; a missing baseline is created from this run.
+ */
+int run_benchmark(struct ctx *conf, char **sources, int num_sources,
+		  const char *baseline, int threshold)
+{
+	unsigned long frames, total_frames = 0;
+	int64_t start, clip_start;
+	double secs, total_secs, fps, base;
 	int i;
 
-	if (ctx->num_fingers == NUM_FINGERS) {
+	start = cvGetTickCount();
 
-#if defined(SHOW_HAND_CONTOUR)
-		cvDrawContours(ctx->image, ctx->contour, BLUE, GREEN, 0, 1,
-			       CV_AA, cvPoint(0, 0));
-#endif
-		cvCircle(ctx->image, ctx->hand_center, 5, PURPLE, 1, CV_AA, 0);
-		cvCircle(ctx->image, ctx->hand_center, ctx->hand_radius,
-			 RED, 1, CV_AA, 0);
+	for (i = 0; i < num_sources && !quit; i++) {
+		struct ctx ctx = *conf;
 
-		for (i = 0; i < ctx->num_fingers; i++) {
+		set_source(&ctx, sources[i]);
+		ctx.headless = 1;
+		ctx.record = 0;
 
-			cvCircle(ctx->image, ctx->fingers[i], 10,
-				 GREEN, 3, CV_AA, 0);
+		init_capture(&ctx);
+		init_detector(&ctx);
 
-			cvLine(ctx->image, ctx->hand_center, ctx->fingers[i],
-			       YELLOW, 1, CV_AA, 0);
+		clip_start = cvGetTickCount();
+		frames = 0;
+
+		/* init_capture() already grabbed the first frame */
+		while (ctx.image && !quit) {
+			ctx.timestamp = ctx.frame.timestamp;
+
+			STATS_TIME(STAGE_FRAME, detect(&ctx));
+			publish(&ctx);
+			ctx.num_frames++;
+			frames++;
+
+			if (ctx.max_frames && ctx.num_frames >= ctx.max_frames)
+				break;
+			ctx.image = next_frame(&ctx);
 		}
 
-		for (i = 0; i < ctx->num_defects; i++) {
-			cvCircle(ctx->image, ctx->defects[i], 2,
-				 GREY, 2, CV_AA, 0);
+		secs = (cvGetTickCount() - clip_start) /
+			(cvGetTickFrequency() * 1e6);
+		fprintf(stderr, "%s: %lu frames, %.1f fps\n", ctx.source,
+			frames, secs > 0 ? frames / secs : 0.0);
+
+		total_frames += frames;
+		release_detector(&ctx);
+	}
+
+	total_secs = (cvGetTickCount() - start) / (cvGetTickFrequency() * 1e6);
+	fps = total_secs > 0 ? total_frames / total_secs : 0.0;
+	fprintf(stderr, "total: %lu frames in %.2f s, %.1f fps\n",
+		total_frames, total_secs, fps);
+
+	if (!baseline)
+		return 0;
+
+	if (read_baseline(baseline, &base) < 0) {
+		if (write_baseline(baseline, fps) < 0) {
+			fprintf(stderr, "Error writing baseline %s\n",
+				baseline);
+			return 1;
 		}
+		fprintf(stderr, "baseline: %.1f fps, saved to %s\n", fps,
+			baseline);
+		return 0;
 	}
 
-	cvShowImage("output", ctx->image);
-	cvShowImage("thresholded", ctx->thr_image);
+	fprintf(stderr, "baseline: %.1f fps, change %+.1f%%\n", base,
+		base > 0 ? 100 * (fps - base) / base : 0.0);
+
+	if (fps < base * (100 - threshold) / 100) {
+		fprintf(stderr, "Throughput regressed by more than %d%%\n",
+			threshold);
+		return 1;
+	}
+
+	return 0;
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [SOURCE...]\n"
+		"Each SOURCE is a camera index, a video file, a URL,\n"
+		"shm:NAME for a shared memory ring, v4l2:DEVICE for a BGR24\n"
+		"V4L2 device or dmabuf:SOCKET for DMA-BUF frames (default:\n"
+		"camera " VIDEO_SOURCE "), optionally followed by #N to\n"
+		"set its detection scale. Several sources are processed\n"
+		"in parallel without windows. Processing stops when sources\n"
+		"end, on SIGINT/SIGTERM or with 'q' in the output window.\n"
+		"  -L          classify skin with a lookup table built from\n"
+		"              the default HSV thresholds\n"
+		"  -l FILE     classify skin with the lookup table in FILE\n"
+		"  -w FILE     write the default lookup table to FILE and exit\n"
+		"  -r N        only process a window around the last detected\n"
+		"              hand, scanning the whole frame every N frames\n"
+		"  -c N        follow the hand border from the last frame,\n"
+		"              searching all contours every N frames\n"
+		"  -d N        detect on frames downsampled by N (1 to %d),\n"
+		"              refining fingertips at full resolution\n"
+		"  -q N        denoise quality: 0 fastest, 1 fast, 2 full\n"
+		"              (default)\n"
+		"  -i N        skip detection on frames where nothing moved,\n"
+		"              detecting at least every N frames\n"
+		"  -I N        grey level change seen as motion (default %d)\n"
+		"  -g          segment on the GPU with OpenCL, if available\n"
+		"  -P N        segment each frame in N tiles on N threads,\n"
+		"              at most %d\n"
+		"  -a          adapt the skin thresholds to the detected hands\n"
+		"  -k          smooth results over time with a Kalman filter\n"
+		"  -K N        detect every N frames, predicting the frames\n"
+		"              in between with the filter\n"
+		"  -m N        detect up to N hands per frame (default 1,\n"
+		"              at most %d)\n"
+		"  -F          grab on a thread and always detect on the newest\n"
+		"              frame, dropping stale ones (for cameras)\n"
+		"  -t          run capture, detection and output on separate\n"
+		"              threads\n"
+		"  -Q N        depth of the queues between threads (default %d)\n"
+		"  -D          drop the oldest frame when a queue is full,\n"
+		"              instead of waiting\n"
+		"  -j N        worker threads for several sources (default:\n"
+		"              one per core)\n"
+		"  -H          headless: no windows and no drawing\n"
+		"  -n          do not record the output\n"
+		"  -C FOURCC   recording codec, eg. H264 or XVID (default\n"
+		"              " VIDEO_CODEC ")\n"
+		"  -R N        only record while a hand is detected, with N\n"
+		"              frames before and after\n"
+		"  -f N        stop after N frames\n"
+		"  -o DEST     write the results of each frame to DEST: a file,\n"
+		"              a named pipe, unix:SOCKET or - for stdout\n"
+		"  -J          write results as JSON lines instead of binary\n"
+		"              records\n"
+#if defined(ENABLE_STATS)
+		"  -S SECS     print per-stage latency statistics every SECS\n"
+#endif
+		"  -B          benchmark: replay all sources one after the\n"
+		"              other, headless and as fast as possible\n"
+		"  -b FILE     benchmark baseline, created if missing\n"
+		"  -T PCT      allowed throughput regression against the\n"
+		"              baseline (default %d%%)\n"
+		"  -A          batch: detect on all the frames of the video\n"
+		"              files on all cores, writing results in order;\n"
+		"              timestamps are media times\n"
+		"  -s N        frames per batch segment (default %d)\n"
+		"  -h          show this help\n",
+		prog, MAX_SCALE, CHANGE_LEVEL, MAX_SEG_THREADS, MAX_HANDS,
+		PIPELINE_DEPTH, BENCH_THRESHOLD, BATCH_SEGMENT);
+}
+
+/* Results destination and format, shared by all streams */
+static const char *sink_path;
+static enum sink_format sink_format = SINK_BINARY;
+static int stats_interval;
+
+static int benchmark;
+static const char *bench_baseline;
+static int bench_threshold = BENCH_THRESHOLD;
+
+static int batch;
+static int batch_segment = BATCH_SEGMENT;
+
+void parse_options(struct ctx *ctx, int argc, char **argv)
+{
+	struct skin_hsv hsv;
+	struct skin_lut lut;
+	int opt;
+
+	ctx->pipeline_depth = PIPELINE_DEPTH;
+	ctx->pipeline_policy = RING_BLOCK;
+	ctx->record = 1;
+	hand_config_init(&ctx->conf);
+
+	while ((opt = getopt(argc, argv, "Ll:w:r:c:d:q:i:I:gP:akK:m:FtQ:Dj:HnC:R:f:o:JS:Bb:T:As:h")) != -1) {
+		switch (opt) {
+		case 'L':
+			ctx->conf.skin_type = SKIN_MODEL_LUT;
+			break;
+		case 'l':
+			ctx->conf.skin_type = SKIN_MODEL_LUT;
+			ctx->conf.skin_lut_file = optarg;
+			break;
+		case 'w':
+			/* Starting point for per-site calibration */
+			if (skin_hsv_init(&hsv, SKIN_HSV_MIN, SKIN_HSV_MAX) < 0)
+				exit(1);
+			skin_lut_from_hsv(&lut, &hsv);
+			if (skin_lut_save(&lut, optarg) < 0) {
+				fprintf(stderr, "Error writing %s\n", optarg);
+				exit(1);
+			}
+			exit(0);
+		case 'r':
+			ctx->conf.roi_rescan = atoi(optarg);
+			if (ctx->conf.roi_rescan < 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'c':
+			ctx->conf.track_rescan = atoi(optarg);
+			if (ctx->conf.track_rescan < 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'd':
+			ctx->conf.scale = atoi(optarg);
+			if (ctx->conf.scale < 1 || ctx->conf.scale > MAX_SCALE) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'q':
+			ctx->conf.denoise = atoi(optarg);
+			if (ctx->conf.denoise < DENOISE_FASTEST ||
+			    ctx->conf.denoise > DENOISE_FULL) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'i':
+			ctx->conf.change_refresh = atoi(optarg);
+			if (ctx->conf.change_refresh < 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'I':
+			ctx->conf.change_level = atoi(optarg);
+			if (ctx->conf.change_level <= 0 || ctx->conf.change_level > 255) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'g':
+			ctx->conf.use_gpu = 1;
+			break;
+		case 'P':
+			ctx->conf.seg_threads = atoi(optarg);
+			if (ctx->conf.seg_threads <= 0 ||
+			    ctx->conf.seg_threads > MAX_SEG_THREADS) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'a':
+			ctx->conf.calibrate = 1;
+			break;
+		case 'k':
+			ctx->conf.filter = 1;
+			break;
+		case 'K':
+			ctx->conf.detect_interval = atoi(optarg);
+			if (ctx->conf.detect_interval <= 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'm':
+			ctx->conf.max_hands = atoi(optarg);
+			if (ctx->conf.max_hands < 1 ||
+			    ctx->conf.max_hands > MAX_HANDS) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'F':
+			ctx->latest = 1;
+			break;
+		case 't':
+			ctx->pipeline = 1;
+			break;
+		case 'Q':
+			ctx->pipeline_depth = atoi(optarg);
+			if (ctx->pipeline_depth <= 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'D':
+			ctx->pipeline_policy = RING_DROP_OLDEST;
+			break;
+		case 'j':
+			ctx->num_workers = atoi(optarg);
+			if (ctx->num_workers <= 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'H':
+			ctx->headless = 1;
+			break;
+		case 'n':
+			ctx->record = 0;
+			break;
+		case 'C':
+			ctx->codec = optarg;
+			break;
+		case 'R':
+			ctx->preroll = atoi(optarg);
+			if (ctx->preroll <= 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'f':
+			ctx->max_frames = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			sink_path = optarg;
+			break;
+		case 'J':
+			sink_format = SINK_JSON;
+			break;
+		case 'S':
+			stats_interval = atoi(optarg);
+			break;
+		case 'B':
+			benchmark = 1;
+			break;
+		case 'b':
+			bench_baseline = optarg;
+			break;
+		case 'T':
+			bench_threshold = atoi(optarg);
+			if (bench_threshold < 0 || bench_threshold > 100) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'A':
+			batch = 1;
+			break;
+		case 's':
+			batch_segment = atoi(optarg);
+			if (batch_segment <= 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
 }
 
 int main(int argc, char **argv)
 {
 	struct ctx ctx = { };
-	int key;
+	struct hand_stats stats;
+	struct sink sink;
+	int ret = 0;
+
+	parse_options(&ctx, argc, argv);
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	/* Results readers may go away, that's reported by the sink */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (stats_start_reporter(stats_interval) < 0) {
+		fprintf(stderr, "Error starting statistics reporter\n");
+		exit(1);
+	}
+
+	if (sink_path) {
+		if (sink_open(&sink, sink_path, sink_format) < 0) {
+			fprintf(stderr, "Error opening results output %s\n",
+				sink_path);
+			exit(1);
+		}
+		ctx.sink = &sink;
+	}
+
+	if (batch) {
+		struct batch_config conf = {
+			.detector	= ctx.conf,
+			.num_workers	= ctx.num_workers,
+			.segment_frames	= batch_segment,
+			.stop		= &quit,
+		};
+
+		if (optind == argc) {
+			fprintf(stderr, "No files to process\n");
+			exit(1);
+		}
+		/* Nothing is live, so wait for the output rather than drop */
+		if (ctx.sink)
+			ctx.sink->lossless = 1;
+		ret = batch_run(&conf, argv + optind, argc - optind,
+				ctx.sink) < 0;
+		goto close;
+	}
+
+	if (benchmark) {
+		if (optind == argc) {
+			fprintf(stderr, "No clips to benchmark\n");
+			exit(1);
+		}
+		ret = run_benchmark(&ctx, argv + optind, argc - optind,
+				    bench_baseline, bench_threshold);
+		goto close;
+	}
+
+	if (argc - optind > 1) {
+		run_streams(&ctx, argv + optind, argc - optind);
+		goto close;
+	}
+
+	if (optind < argc)
+		set_source(&ctx, argv[optind]);
+	else
+		ctx.source = VIDEO_SOURCE;
+	snprintf(ctx.video_file, sizeof(ctx.video_file), "%s", VIDEO_FILE);
 
 	init_capture(&ctx);
-	init_recording(&ctx);
-	init_windows();
-	init_ctx(&ctx);
+	if (ctx.record)
+		init_recording(&ctx);
+	if (!ctx.headless)
+		init_windows();
+	init_detector(&ctx);
+
+	if (ctx.latest) {
+		run_latest(&ctx);
+		goto out;
+	}
 
-	do {
-		ctx.image = cvQueryFrame(ctx.capture);
+	if (ctx.pipeline) {
+		run_pipeline(&ctx);
+		goto out;
+	}
 
-		filter_and_threshold(&ctx);
-		find_contour(&ctx);
-		find_convex_hull(&ctx);
-		find_fingers(&ctx);
+	while (!quit) {
+		if (ctx.max_frames && ctx.num_frames >= ctx.max_frames)
+			break;
 
-		display(&ctx);
-		cvWriteFrame(ctx.writer, ctx.image);
+		ctx.image = next_frame(&ctx);
+		if (!ctx.image)
+			break;
+		ctx.timestamp = ctx.frame.timestamp;
 
-		key = cvWaitKey(1);
-	} while (key != 'q');
+		STATS_TIME(STAGE_FRAME, detect(&ctx));
+		publish(&ctx);
+		STATS_TIME(STAGE_DISPLAY, display(&ctx));
+		if (ctx.recorder)
+			recorder_write(ctx.recorder, ctx.out_image,
+				       detector_found(ctx.det));
 
-	return 0;
+		ctx.num_frames++;
+
+		if (!ctx.headless && cvWaitKey(1) == 'q')
+			break;
+	}
+
+out:
+	hand_detector_stats(ctx.det, &stats);
+	fprintf(stderr, "Peak storage usage per frame: %zu bytes, "
+		"%lu frames allocated memory\n", stats.storage_peak,
+		stats.alloc_frames);
+	if (ctx.conf.change_refresh)
+		fprintf(stderr, "Unchanged frames skipped: %lu of %lu\n",
+			stats.idle_frames, ctx.num_frames);
+	if (ctx.conf.detect_interval > 1)
+		fprintf(stderr, "Frames predicted: %lu of %lu\n",
+			stats.predicted_frames, ctx.num_frames);
+	if (ctx.conf.calibrate)
+		fprintf(stderr, "Skin models calibrated: %lu\n",
+			stats.skin_updates);
+
+	stop_recording(&ctx);
+	release_detector(&ctx);
+
+close:
+	if (ctx.sink)
+		sink_close(ctx.sink);
+
+	stats_print();
+
+	return ret;
 }
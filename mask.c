@@ -0,0 +1,453 @@
+/*
+ * Bit packed binary masks
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mask.h"
+
+#define WORD_BITS	64
+
+int mask_init(struct bitmask *m, int width, int height)
+{
+	memset(m, 0, sizeof(*m));
+
+	m->max_width = width;
+	m->max_height = height;
+	m->words = (width + WORD_BITS - 1) / WORD_BITS;
+
+	/* One extra word per row lets shifts read past the last word */
+	m->bits = calloc((size_t)m->words * height, sizeof(uint64_t));
+	m->tmp = calloc((size_t)(m->words + 2) * height, sizeof(uint64_t));
+	if (!m->bits || !m->tmp) {
+		mask_free(m);
+		return -1;
+	}
+
+	return 0;
+}
+
+void mask_free(struct bitmask *m)
+{
+	free(m->bits);
+	free(m->tmp);
+	m->bits = m->tmp = NULL;
+}
+
+static inline uint64_t tail_bits(const struct bitmask *m)
+{
+	int n = m->width % WORD_BITS;
+
+	return n ? (UINT64_C(1) << n) - 1 : ~UINT64_C(0);
+}
+
+/* Pack the ROI of an 8-bit image: every non-zero pixel is set */
+void mask_pack(struct bitmask *m, const IplImage *src)
+{
+	CvRect r = cvGetImageROI(src);
+	uint64_t word;
+	int i, x, y, w, n;
+
+	m->width = MIN(r.width, m->max_width);
+	m->height = MIN(r.height, m->max_height);
+
+	for (y = 0; y < m->height; y++) {
+		const uchar *s = (const uchar *)src->imageData +
+			(r.y + y) * src->widthStep + r.x;
+		uint64_t *row = mask_row(m, y);
+
+		for (w = 0, x = 0; x < m->width; w++) {
+			word = 0;
+			n = MIN(m->width - x, WORD_BITS);
+			for (i = 0; i < n; i++, x++)
+				word |= (uint64_t)(s[x] != 0) << i;
+			row[w] = word;
+		}
+		for (; w < m->words; w++)
+			row[w] = 0;
+	}
+}
+
+/* Unpack into the ROI of an 8-bit image as 0/255 pixels */
+void mask_unpack(const struct bitmask *m, IplImage *dst)
+{
+	CvRect r = cvGetImageROI(dst);
+	int x, y;
+
+	for (y = 0; y < m->height && y < r.height; y++) {
+		uchar *d = (uchar *)dst->imageData +
+			(r.y + y) * dst->widthStep + r.x;
+		const uint64_t *row = mask_row(m, y);
+
+		for (x = 0; x < m->width && x < r.width; x++)
+			d[x] = (row[x >> 6] >> (x & 63)) & 1 ? 255 : 0;
+	}
+}
+
+/*
+ * Horizontal erosion (and = 1) or dilation (and = 0) of a row by r.
+ * Pixels outside the row never change the result, as with the default
+ * border of OpenCV morphology: they read as 1 for erosion and 0 for
+ * dilation. ext has room for one word before and after the row.
+ */
+static void row_op(const struct bitmask *m, uint64_t *row, uint64_t *ext,
+		   int r, int and)
+{
+	uint64_t fill = and ? ~UINT64_C(0) : 0;
+	uint64_t *src = ext + 1, acc, right, left;
+	int nw = (m->width + WORD_BITS - 1) / WORD_BITS;
+	int w, d;
+
+	/* Only the words covering the current width hold pixels */
+	ext[0] = fill;
+	memcpy(src, row, nw * sizeof(uint64_t));
+	src[nw - 1] = (src[nw - 1] & tail_bits(m)) | (fill & ~tail_bits(m));
+	for (w = nw; w <= m->words; w++)
+		src[w] = fill;
+
+	for (w = 0; w < nw; w++) {
+		acc = src[w];
+		for (d = 1; d <= r; d++) {
+			/* Pixel x + d and x - d seen at position x */
+			right = (src[w] >> d) | (src[w + 1] << (WORD_BITS - d));
+			left = (src[w] << d) | (src[w - 1] >> (WORD_BITS - d));
+			acc = and ? acc & right & left : acc | right | left;
+		}
+		row[w] = acc;
+	}
+
+	row[nw - 1] &= tail_bits(m);
+	for (w = nw; w < m->words; w++)
+		row[w] = 0;
+}
+
+static void col_op(struct bitmask *m, int r, int and)
+{
+	uint64_t *out = m->tmp, acc;
+	int x, y, d, yy;
+
+	for (y = 0; y < m->height; y++) {
+		for (x = 0; x < m->words; x++) {
+			acc = mask_row(m, y)[x];
+			for (d = -r; d <= r; d++) {
+				yy = y + d;
+				if (yy < 0 || yy >= m->height || !d)
+					continue;
+				if (and)
+					acc &= mask_row(m, yy)[x];
+				else
+					acc |= mask_row(m, yy)[x];
+			}
+			out[(size_t)y * m->words + x] = acc;
+		}
+	}
+
+	memcpy(m->bits, out, (size_t)m->words * m->height * sizeof(uint64_t));
+}
+
+static void morph(struct bitmask *m, int r, int and)
+{
+	uint64_t *ext = m->tmp;
+	int y;
+
+	if (!m->width || !m->height || r <= 0)
+		return;
+
+	/* The (2r+1) x (2r+1) rectangle is separable */
+	for (y = 0; y < m->height; y++)
+		row_op(m, mask_row(m, y), ext, r, and);
+	col_op(m, r, and);
+}
+
+/* Erode with a (2r+1) x (2r+1) rectangle, r < 64 */
+void mask_erode(struct bitmask *m, int r)
+{
+	morph(m, r, 1);
+}
+
+/* Dilate with a (2r+1) x (2r+1) rectangle, r < 64 */
+void mask_dilate(struct bitmask *m, int r)
+{
+	morph(m, r, 0);
+}
+
+/* Horizontal run of set pixels, from x0 included to x1 excluded */
+struct mask_run {
+	int		x0;
+	int		x1;
+	int		y;
+	int		parent;		/* Union-find link, to a lower index */
+	int		blob;
+};
+
+/* Index of the first pixel from x on whose value is set, or the width */
+static int next_pixel(const struct bitmask *m, const uint64_t *row, int x,
+		      int set)
+{
+	uint64_t word;
+	int w = x / WORD_BITS;
+
+	if (x >= m->width)
+		return m->width;
+
+	word = (set ? row[w] : ~row[w]) & (~UINT64_C(0) << (x % WORD_BITS));
+	while (!word) {
+		if (++w >= m->words)
+			return m->width;
+		word = set ? row[w] : ~row[w];
+	}
+
+	return MIN(w * WORD_BITS + __builtin_ctzll(word), m->width);
+}
+
+static int grow(void **array, int *size, int need, size_t elem)
+{
+	void *p;
+	int n = *size ? *size : 256;
+
+	if (need <= *size)
+		return 0;
+	while (n < need)
+		n *= 2;
+
+	p = realloc(*array, n * elem);
+	if (!p)
+		return -1;
+	*array = p;
+	*size = n;
+	return 0;
+}
+
+static int find_root(struct mask_run *runs, int i)
+{
+	while (runs[i].parent != i) {
+		/* Path halving */
+		runs[i].parent = runs[runs[i].parent].parent;
+		i = runs[i].parent;
+	}
+
+	return i;
+}
+
+static void merge(struct mask_run *runs, int a, int b)
+{
+	a = find_root(runs, a);
+	b = find_root(runs, b);
+
+	/* The root of a component is its first run in raster order */
+	if (a < b)
+		runs[b].parent = a;
+	else if (b < a)
+		runs[a].parent = b;
+}
+
+/*
+ * Label the 8-connected components of a mask in one scan: runs of set
+ * pixels are extracted a word at a time, joined with the runs they touch
+ * in the row above, and the area and bounding box of each component are
+ * summed from its runs. Returns the number of components, or -1 when
+ * out of memory.
+ */
+int mask_label(const struct bitmask *m, struct mask_labels *l)
+{
+	struct mask_run *run;
+	struct mask_blob *b;
+	int x, x1, y, i, j, k, prev = 0, cur, root;
+
+	l->num_runs = 0;
+	l->num_blobs = 0;
+
+	for (y = 0; y < m->height; y++) {
+		const uint64_t *row = mask_row(m, y);
+
+		/* Runs of the previous row start at prev */
+		cur = l->num_runs;
+		for (x = next_pixel(m, row, 0, 1); x < m->width;
+		     x = next_pixel(m, row, x1, 1)) {
+			x1 = next_pixel(m, row, x, 0);
+			if (grow((void **)&l->runs, &l->max_runs,
+				 l->num_runs + 1, sizeof(*l->runs)) < 0)
+				return -1;
+			run = &l->runs[l->num_runs];
+			run->x0 = x;
+			run->x1 = x1;
+			run->y = y;
+			run->parent = l->num_runs++;
+		}
+
+		/* Runs touch when they overlap or meet at a corner */
+		for (i = prev, k = cur; k < l->num_runs; k++) {
+			run = &l->runs[k];
+			while (i < cur && l->runs[i].x1 < run->x0)
+				i++;
+			for (j = i; j < cur && l->runs[j].x0 <= run->x1; j++)
+				merge(l->runs, j, k);
+		}
+		prev = cur;
+	}
+
+	for (k = 0; k < l->num_runs; k++) {
+		run = &l->runs[k];
+		root = find_root(l->runs, k);
+
+		if (root == k) {
+			if (grow((void **)&l->blobs, &l->max_blobs,
+				 l->num_blobs + 1, sizeof(*l->blobs)) < 0)
+				return -1;
+			run->blob = l->num_blobs++;
+			b = &l->blobs[run->blob];
+			b->area = 0;
+			b->rect = cvRect(run->x0, run->y, 0, 1);
+			b->start = cvPoint(run->x0, run->y);
+		} else {
+			run->blob = l->runs[root].blob;
+			b = &l->blobs[run->blob];
+		}
+
+		/* Width and height hold the right and bottom edges for now */
+		b->area += run->x1 - run->x0;
+		b->rect.x = MIN(b->rect.x, run->x0);
+		b->rect.width = MAX(b->rect.width, run->x1);
+		b->rect.height = run->y + 1;
+	}
+
+	for (i = 0; i < l->num_blobs; i++) {
+		b = &l->blobs[i];
+		b->rect.width -= b->rect.x;
+		b->rect.height -= b->rect.y;
+	}
+
+	return l->num_blobs;
+}
+
+void mask_labels_free(struct mask_labels *l)
+{
+	free(l->runs);
+	free(l->blobs);
+	memset(l, 0, sizeof(*l));
+}
+
+/*
+ * Neighbours of a pixel in clockwise order, image y pointing down, and
+ * the index of each offset in that table
+ */
+static const int dir_x[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+static const int dir_y[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+static const int dir_index[3][3] = {
+	{ 5, 6, 7 },
+	{ 4, -1, 0 },
+	{ 3, 2, 1 },
+};
+
+static inline int mask_test(const struct bitmask *m, int x, int y)
+{
+	if (x < 0 || y < 0 || x >= m->width || y >= m->height)
+		return 0;
+
+	return mask_get(m, x, y);
+}
+
+/*
+ * Find a border pixel of the blob nearest to p, within radius pixels.
+ * The nearest set pixel is moved left until its west neighbour is clear,
+ * which makes it a valid start for mask_trace(). Returns -1 if no pixel
+ * is set in the window.
+ */
+int mask_find_border(const struct bitmask *m, CvPoint *p, int radius)
+{
+	int x, y, d, best = -1;
+	CvPoint q = *p;
+
+	for (y = MAX(p->y - radius, 0);
+	     y <= p->y + radius && y < m->height; y++) {
+		for (x = MAX(p->x - radius, 0);
+		     x <= p->x + radius && x < m->width; x++) {
+			if (!mask_get(m, x, y))
+				continue;
+			d = (x - p->x) * (x - p->x) + (y - p->y) * (y - p->y);
+			if (best < 0 || d < best) {
+				best = d;
+				q = cvPoint(x, y);
+			}
+		}
+	}
+
+	if (best < 0)
+		return -1;
+
+	while (mask_test(m, q.x - 1, q.y))
+		q.x--;
+
+	*p = q;
+	return 0;
+}
+
+/*
+ * Follow the border of the blob through start, whose west neighbour must
+ * be clear, clockwise with 8-connectivity (Moore neighbour tracing). Only
+ * the points where the direction changes are written, as with
+ * CV_CHAIN_APPROX_SIMPLE, moved by offset. The cost is proportional to
+ * the length of the border. Returns the number of points written.
+ */
+int mask_trace(const struct bitmask *m, CvPoint start, CvPoint offset,
+	       CvSeqWriter *writer)
+{
+	CvPoint c = start, pt;
+	int back = 4;			/* Direction of a clear neighbour */
+	int first = -1, last = -1;
+	int i, k, n = 0;
+	long steps, max_steps = 2L * m->width * m->height + 8;
+
+	for (steps = 0; steps < max_steps; steps++) {
+		/* First set neighbour clockwise from the clear one */
+		for (i = 1; i <= 8; i++) {
+			k = (back + i) & 7;
+			if (mask_test(m, c.x + dir_x[k], c.y + dir_y[k]))
+				break;
+		}
+
+		if (i > 8) {
+			/* Isolated pixel */
+			pt = cvPoint(c.x + offset.x, c.y + offset.y);
+			CV_WRITE_SEQ_ELEM(pt, *writer);
+			return 1;
+		}
+
+		/* Back at the start, leaving the way it left first */
+		if (c.x == start.x && c.y == start.y) {
+			if (k == first)
+				break;
+			if (first < 0)
+				first = k;
+		}
+
+		if (k != last) {
+			pt = cvPoint(c.x + offset.x, c.y + offset.y);
+			CV_WRITE_SEQ_ELEM(pt, *writer);
+			n++;
+			last = k;
+		}
+
+		/* The neighbour examined before k is clear, seen from c + k */
+		i = (k + 7) & 7;
+		back = dir_index[dir_y[i] - dir_y[k] + 1][dir_x[i] - dir_x[k] + 1];
+		c.x += dir_x[k];
+		c.y += dir_y[k];
+	}
+
+	return n;
+}
@@ -0,0 +1,87 @@
+/*
+ * Bit packed binary masks
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef MASK_H
+#define MASK_H
+
+#include <stdint.h>
+
+#include <opencv2/core/core_c.h>
+
+/*
+ * Binary image with one bit per pixel. Pixel x of a row is bit x % 64
+ * of word x / 64, and every row starts on a new word. Bits past the
+ * width of a row are kept clear.
+ */
+struct bitmask {
+	int		width;		/* Size of the current content */
+	int		height;
+	int		words;		/* Words per row */
+	int		max_width;	/* Allocated size */
+	int		max_height;
+	uint64_t	*bits;
+	uint64_t	*tmp;		/* Scratch rows for separable ops */
+};
+
+/* Connected component of a mask */
+struct mask_blob {
+	int		area;		/* Pixels set */
+	CvRect		rect;		/* Bounding box */
+	CvPoint		start;		/* First pixel in raster order */
+};
+
+/*
+ * Components found by mask_label(), largest or not in no given order.
+ * The arrays grow to fit the busiest mask seen and are kept, so that
+ * labelling stops allocating once the scene is known.
+ */
+struct mask_labels {
+	struct mask_run	*runs;		/* Private to mask.c */
+	int		num_runs;
+	int		max_runs;
+	struct mask_blob *blobs;
+	int		num_blobs;
+	int		max_blobs;
+};
+
+int mask_init(struct bitmask *m, int width, int height);
+void mask_free(struct bitmask *m);
+
+void mask_pack(struct bitmask *m, const IplImage *src);
+void mask_unpack(const struct bitmask *m, IplImage *dst);
+
+void mask_erode(struct bitmask *m, int r);
+void mask_dilate(struct bitmask *m, int r);
+
+int mask_label(const struct bitmask *m, struct mask_labels *l);
+void mask_labels_free(struct mask_labels *l);
+
+int mask_find_border(const struct bitmask *m, CvPoint *p, int radius);
+int mask_trace(const struct bitmask *m, CvPoint start, CvPoint offset,
+	       CvSeqWriter *writer);
+
+static inline uint64_t *mask_row(const struct bitmask *m, int y)
+{
+	return m->bits + (size_t)y * m->words;
+}
+
+static inline int mask_get(const struct bitmask *m, int x, int y)
+{
+	return (mask_row(m, y)[x >> 6] >> (x & 63)) & 1;
+}
+
+#endif
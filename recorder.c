@@ -0,0 +1,190 @@
+/*
+ * Asynchronous video recording
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "recorder.h"
+#include "stats.h"
+
+#define RECORD_QUEUE	8		/* Frames waiting for the encoder */
+#define RECORD_POLL_US	1000
+
+static void *recorder_thread(void *arg)
+{
+	struct recorder *rec = arg;
+	IplImage *frame;
+	int stop;
+
+	for (;;) {
+		/* Frames queued before stop was set are still seen below */
+		stop = atomic_load(&rec->stop);
+
+		frame = ring_pop(&rec->queue);
+		if (frame) {
+			STATS_TIME(STAGE_RECORD,
+				   cvWriteFrame(rec->writer, frame));
+			rec->written++;
+			ring_push(&rec->free_q, frame, NULL);
+			continue;
+		}
+
+		if (stop)
+			break;
+
+		usleep(RECORD_POLL_US);
+	}
+
+	return NULL;
+}
+
+static void free_frames(struct recorder *rec)
+{
+	int i;
+
+	for (i = 0; i < rec->num_frames; i++)
+		if (rec->frames[i])
+			cvReleaseImage(&rec->frames[i]);
+	free(rec->frames);
+	free(rec->preroll);
+	ring_free(&rec->queue);
+	ring_free(&rec->free_q);
+}
+
+int recorder_open(struct recorder *rec, const char *path, int fourcc,
+		  double fps, CvSize size, int preroll)
+{
+	int i;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->preroll_len = preroll;
+	rec->num_frames = RECORD_QUEUE + preroll;
+
+	rec->frames = calloc(rec->num_frames, sizeof(*rec->frames));
+	rec->preroll = calloc(preroll + 1, sizeof(*rec->preroll));
+	if (!rec->frames || !rec->preroll ||
+	    ring_init(&rec->queue, rec->num_frames, RING_BLOCK) < 0 ||
+	    ring_init(&rec->free_q, rec->num_frames, RING_BLOCK) < 0)
+		goto err;
+
+	for (i = 0; i < rec->num_frames; i++) {
+		rec->frames[i] = cvCreateImage(size, 8, 3);
+		if (!rec->frames[i])
+			goto err;
+		ring_push(&rec->free_q, rec->frames[i], NULL);
+	}
+
+	rec->writer = cvCreateVideoWriter(path, fourcc, fps, size, 1);
+	if (!rec->writer)
+		goto err;
+
+	atomic_init(&rec->stop, 0);
+
+	if (pthread_create(&rec->thread, NULL, recorder_thread, rec)) {
+		cvReleaseVideoWriter(&rec->writer);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	free_frames(rec);
+	return -1;
+}
+
+/* Copy a frame for the encoder, dropping it if the pool is empty */
+static void queue_copy(struct recorder *rec, const IplImage *image)
+{
+	IplImage *frame = ring_pop(&rec->free_q);
+
+	if (!frame) {
+		rec->dropped++;
+		return;
+	}
+
+	cvCopy(image, frame, NULL);
+	/* Can't fail, there are no more frames than slots */
+	ring_push(&rec->queue, frame, NULL);
+}
+
+/*
+ * Record a frame, hand telling whether a hand was detected in it. This
+ * never waits for the encoder.
+ */
+void recorder_write(struct recorder *rec, const IplImage *image, int hand)
+{
+	IplImage *frame;
+	int tail;
+
+	if (!rec->preroll_len) {
+		queue_copy(rec, image);
+		return;
+	}
+
+	if (hand)
+		rec->hold = rec->preroll_len + 1;
+
+	if (rec->hold) {
+		rec->hold--;
+
+		/* Frames seen before the hand go first */
+		while (rec->preroll_count) {
+			ring_push(&rec->queue, rec->preroll[rec->preroll_head],
+				  NULL);
+			rec->preroll_head = (rec->preroll_head + 1) %
+				rec->preroll_len;
+			rec->preroll_count--;
+		}
+
+		queue_copy(rec, image);
+		return;
+	}
+
+	/* No hand: keep the frame, replacing the oldest one if needed */
+	if (rec->preroll_count == rec->preroll_len) {
+		frame = rec->preroll[rec->preroll_head];
+		rec->preroll_head = (rec->preroll_head + 1) % rec->preroll_len;
+		rec->preroll_count--;
+	} else {
+		frame = ring_pop(&rec->free_q);
+		if (!frame) {
+			rec->dropped++;
+			return;
+		}
+	}
+
+	cvCopy(image, frame, NULL);
+	tail = (rec->preroll_head + rec->preroll_count) % rec->preroll_len;
+	rec->preroll[tail] = frame;
+	rec->preroll_count++;
+}
+
+/* Encode all queued frames and close the file */
+void recorder_close(struct recorder *rec)
+{
+	atomic_store(&rec->stop, 1);
+	pthread_join(rec->thread, NULL);
+
+	if (rec->dropped)
+		fprintf(stderr, "Recorded frames dropped: %lu\n",
+			rec->dropped);
+
+	cvReleaseVideoWriter(&rec->writer);
+	free_frames(rec);
+}
@@ -0,0 +1,66 @@
+/*
+ * Asynchronous video recording
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <opencv2/core/core_c.h>
+#include <opencv2/highgui/highgui_c.h>
+
+#include "ring.h"
+
+/*
+ * Frames are copied to a preallocated pool and encoded by a thread of
+ * their own, so encoding and disk I/O never delay the caller. When the
+ * encoder falls behind and no free frame is left, the new frame is
+ * dropped and counted.
+ *
+ * With a non-zero preroll only frames around detections are recorded:
+ * the last preroll frames are kept while no hand is seen, written out
+ * when one appears, and recording goes on for preroll frames after the
+ * hand is lost.
+ */
+struct recorder {
+	CvVideoWriter	*writer;
+
+	IplImage	**frames;	/* Pool */
+	int		num_frames;
+	struct ring	queue;		/* Caller -> encoder */
+	struct ring	free_q;		/* Encoder -> caller */
+
+	IplImage	**preroll;	/* Last frames without a hand */
+	int		preroll_len;
+	int		preroll_head;
+	int		preroll_count;
+	int		hold;		/* Frames left to record */
+
+	pthread_t	thread;
+	atomic_int	stop;
+
+	unsigned long	written;
+	unsigned long	dropped;
+};
+
+int recorder_open(struct recorder *rec, const char *path, int fourcc,
+		  double fps, CvSize size, int preroll);
+void recorder_write(struct recorder *rec, const IplImage *image, int hand);
+void recorder_close(struct recorder *rec);
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * Hand detection result
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef RESULT_H
+#define RESULT_H
+
+#include <opencv2/core/core_c.h>
+
+#define NUM_FINGERS	5
+#define NUM_DEFECTS	8
+#define MAX_HANDS	4
+
+/*
+ * Result of the detection on one frame. It holds no pointers, so it can
+ * be copied around and consumed after the frame is gone.
+ */
+struct hand_result {
+	CvPoint		center;
+	int		radius;
+	int		num_fingers;
+	int		num_defects;
+	CvPoint		fingers[NUM_FINGERS + 1];	/* Fingertips */
+	CvPoint		defects[NUM_DEFECTS];	/* Defects depth points */
+};
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Bounded single-producer/single-consumer ring
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+int ring_init(struct ring *r, unsigned long size, enum ring_policy policy)
+{
+	unsigned long i;
+
+	memset(r, 0, sizeof(*r));
+
+	if (!size)
+		return -1;
+
+	r->slots = calloc(size, sizeof(*r->slots));
+	if (!r->slots)
+		return -1;
+
+	for (i = 0; i < size; i++)
+		atomic_init(&r->slots[i], NULL);
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	r->size = size;
+	r->policy = policy;
+
+	return 0;
+}
+
+void ring_free(struct ring *r)
+{
+	free(r->slots);
+	r->slots = NULL;
+}
+
+/*
+ * Queue an item. Returns -1 if the ring is full and the policy is
+ * RING_BLOCK, leaving the waiting strategy to the caller. With
+ * RING_DROP_OLDEST the push always succeeds; the evicted item, if any,
+ * is stored in *evicted and ownership goes back to the producer.
+ */
+int ring_push(struct ring *r, void *item, void **evicted)
+{
+	unsigned long head, tail, depth;
+	void *old;
+
+	if (evicted)
+		*evicted = NULL;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	while (tail - head >= r->size) {
+		if (r->policy == RING_BLOCK)
+			return -1;
+
+		old = atomic_load_explicit(&r->slots[head % r->size],
+					   memory_order_relaxed);
+		if (atomic_compare_exchange_weak_explicit(&r->head, &head,
+							  head + 1,
+							  memory_order_acq_rel,
+							  memory_order_acquire)) {
+			r->dropped++;
+			if (evicted)
+				*evicted = old;
+			head++;
+			break;
+		}
+		/* The consumer won the race, head has been reloaded */
+	}
+
+	atomic_store_explicit(&r->slots[tail % r->size], item,
+			      memory_order_relaxed);
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+	depth = tail + 1 - head;
+	r->pushed++;
+	r->depth_sum += depth;
+	if (depth > r->depth_max)
+		r->depth_max = depth;
+
+	return 0;
+}
+
+/* Dequeue the oldest item, or return NULL if the ring is empty */
+void *ring_pop(struct ring *r)
+{
+	unsigned long head, tail;
+	void *item;
+
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	do {
+		tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (head == tail)
+			return NULL;
+
+		item = atomic_load_explicit(&r->slots[head % r->size],
+					    memory_order_relaxed);
+	} while (!atomic_compare_exchange_weak_explicit(&r->head, &head,
+							head + 1,
+							memory_order_acq_rel,
+							memory_order_acquire));
+
+	return item;
+}
+
+void mailbox_init(struct mailbox *m)
+{
+	memset(m, 0, sizeof(*m));
+	atomic_init(&m->slot, NULL);
+}
+
+/* Publish an item, returning the stale one it replaced, if any */
+void *mailbox_post(struct mailbox *m, void *item)
+{
+	void *old;
+
+	old = atomic_exchange_explicit(&m->slot, item, memory_order_acq_rel);
+
+	m->posted++;
+	if (old)
+		m->stale++;
+
+	return old;
+}
+
+/* Take the newest item, or return NULL if none was posted since */
+void *mailbox_take(struct mailbox *m)
+{
+	return atomic_exchange_explicit(&m->slot, NULL, memory_order_acq_rel);
+}
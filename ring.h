@@ -0,0 +1,76 @@
+/*
+ * Bounded single-producer/single-consumer ring
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+
+enum ring_policy {
+	RING_BLOCK,		/* Producer waits for a free slot */
+	RING_DROP_OLDEST,	/* Producer evicts the oldest item */
+};
+
+/*
+ * Lock-free queue of pointers between exactly one producer thread and
+ * one consumer thread. Indices grow monotonically and are reduced modulo
+ * the size only to address a slot, so the fill level is tail - head.
+ *
+ * Eviction is the only operation where the producer touches the head:
+ * both sides advance it with a compare-and-swap, so an item is owned by
+ * whoever wins it.
+ */
+struct ring {
+	_Atomic(void *)	*slots;
+	unsigned long	size;
+	enum ring_policy policy;
+
+	_Atomic unsigned long head __attribute__((aligned(64)));
+	_Atomic unsigned long tail __attribute__((aligned(64)));
+
+	/* Statistics, only written by the producer */
+	unsigned long	pushed;
+	unsigned long	dropped;
+	unsigned long	depth_max;
+	unsigned long	depth_sum;	/* Sum of depths seen at each push */
+};
+
+/*
+ * Single-slot handoff where only the newest item matters. Posting
+ * replaces the item still in the slot, which goes back to the producer
+ * as stale, and taking empties the slot. Both are a single atomic
+ * exchange, so an item always has exactly one owner.
+ */
+struct mailbox {
+	_Atomic(void *)	slot;
+
+	/* Statistics, only written by the producer */
+	unsigned long	posted;
+	unsigned long	stale;		/* Replaced before being taken */
+};
+
+int ring_init(struct ring *r, unsigned long size, enum ring_policy policy);
+void ring_free(struct ring *r);
+
+int ring_push(struct ring *r, void *item, void **evicted);
+void *ring_pop(struct ring *r);
+
+void mailbox_init(struct mailbox *m);
+void *mailbox_post(struct mailbox *m, void *item);
+void *mailbox_take(struct mailbox *m);
+
+#endif
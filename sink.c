@@ -0,0 +1,272 @@
+/*
+ * Structured output of detection results
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sink.h"
+
+#define SINK_RECORDS	256		/* Records in flight */
+#define SINK_BATCH	(64 * 1024)	/* Flush threshold */
+#define SINK_JSON_MAX	1024		/* Longest JSON line */
+#define SINK_POLL_US	1000
+
+#define UNIX_PREFIX	"unix:"
+
+static int open_unix(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Destinations are "-" for standard output, "unix:PATH" for a UNIX
+ * stream socket, or any other path, which also covers named pipes.
+ */
+static int open_destination(const char *path)
+{
+	if (!strcmp(path, "-"))
+		return dup(STDOUT_FILENO);
+
+	if (!strncmp(path, UNIX_PREFIX, strlen(UNIX_PREFIX)))
+		return open_unix(path + strlen(UNIX_PREFIX));
+
+	return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+static void flush_batch(struct sink *sink)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (!sink->error && off < sink->batch_len) {
+		n = write(sink->fd, sink->batch + off, sink->batch_len - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			sink->error = 1;
+			break;
+		}
+		off += n;
+	}
+
+	sink->batch_len = 0;
+}
+
+static int format_json(char *buf, size_t size, const struct sink_record *r)
+{
+	int i, len;
+
+	len = snprintf(buf, size, "{\"stream\":%u,\"frame\":%u,"
+		       "\"timestamp\":%llu,\"hand\":%d,\"center\":[%d,%d],"
+		       "\"radius\":%d,\"fingers\":[", r->stream, r->frame,
+		       (unsigned long long)r->timestamp, r->hand, r->center[0],
+		       r->center[1], r->radius);
+
+	for (i = 0; i < r->num_fingers; i++)
+		len += snprintf(buf + len, size - len, "%s[%d,%d]",
+				i ? "," : "", r->fingers[i][0],
+				r->fingers[i][1]);
+
+	len += snprintf(buf + len, size - len, "],\"defects\":[");
+
+	for (i = 0; i < r->num_defects; i++)
+		len += snprintf(buf + len, size - len, "%s[%d,%d]",
+				i ? "," : "", r->defects[i][0],
+				r->defects[i][1]);
+
+	len += snprintf(buf + len, size - len, "]}\n");
+
+	return len;
+}
+
+static void batch_record(struct sink *sink, const struct sink_record *r)
+{
+	if (sink->format == SINK_BINARY) {
+		memcpy(sink->batch + sink->batch_len, r, sizeof(*r));
+		sink->batch_len += sizeof(*r);
+	} else {
+		sink->batch_len += format_json(sink->batch + sink->batch_len,
+					       SINK_JSON_MAX, r);
+	}
+
+	sink->written++;
+}
+
+static void *sink_thread(void *arg)
+{
+	struct sink *sink = arg;
+	struct sink_record *r;
+	int stop;
+
+	for (;;) {
+		/* Records queued before stop was set are still seen below */
+		stop = atomic_load(&sink->stop);
+
+		r = ring_pop(&sink->queue);
+		if (r) {
+			batch_record(sink, r);
+			ring_push(&sink->free_q, r, NULL);
+			if (sink->batch_len >= SINK_BATCH)
+				flush_batch(sink);
+			continue;
+		}
+
+		/* Queue drained, write out what we have */
+		if (sink->batch_len)
+			flush_batch(sink);
+		if (stop)
+			break;
+
+		usleep(SINK_POLL_US);
+	}
+
+	return NULL;
+}
+
+int sink_open(struct sink *sink, const char *path, enum sink_format format)
+{
+	int i;
+
+	memset(sink, 0, sizeof(*sink));
+	sink->format = format;
+
+	sink->fd = open_destination(path);
+	if (sink->fd < 0)
+		return -1;
+
+	sink->records = calloc(SINK_RECORDS, sizeof(*sink->records));
+	sink->batch = malloc(SINK_BATCH + SINK_JSON_MAX);
+	if (!sink->records || !sink->batch ||
+	    ring_init(&sink->queue, SINK_RECORDS, RING_BLOCK) < 0 ||
+	    ring_init(&sink->free_q, SINK_RECORDS, RING_BLOCK) < 0)
+		goto err;
+
+	for (i = 0; i < SINK_RECORDS; i++)
+		ring_push(&sink->free_q, &sink->records[i], NULL);
+
+	pthread_mutex_init(&sink->lock, NULL);
+	atomic_init(&sink->stop, 0);
+
+	if (pthread_create(&sink->thread, NULL, sink_thread, sink)) {
+		pthread_mutex_destroy(&sink->lock);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	ring_free(&sink->queue);
+	ring_free(&sink->free_q);
+	free(sink->records);
+	free(sink->batch);
+	close(sink->fd);
+	return -1;
+}
+
+/*
+ * Queue the result for one hand of a frame, without ever blocking on
+ * I/O. Lossless sinks, used for offline processing, wait for the writer
+ * to free a record instead.
+ */
+void sink_write(struct sink *sink, int stream, unsigned long frame,
+		uint64_t timestamp, int index,
+		const struct hand_result *hand)
+{
+	struct sink_record *r;
+	int i;
+
+	pthread_mutex_lock(&sink->lock);
+
+	r = ring_pop(&sink->free_q);
+	while (!r && sink->lossless) {
+		usleep(SINK_POLL_US);
+		r = ring_pop(&sink->free_q);
+	}
+	if (!r) {
+		sink->dropped++;
+		goto out;
+	}
+
+	memset(r, 0, sizeof(*r));
+	r->timestamp = timestamp;
+	r->frame = frame;
+	r->stream = stream;
+	r->hand = index;
+	r->center[0] = hand->center.x;
+	r->center[1] = hand->center.y;
+	r->radius = hand->radius;
+
+	r->num_fingers = hand->num_fingers;
+	for (i = 0; i < hand->num_fingers; i++) {
+		r->fingers[i][0] = hand->fingers[i].x;
+		r->fingers[i][1] = hand->fingers[i].y;
+	}
+
+	r->num_defects = hand->num_defects;
+	for (i = 0; i < hand->num_defects; i++) {
+		r->defects[i][0] = hand->defects[i].x;
+		r->defects[i][1] = hand->defects[i].y;
+	}
+
+	/* Can't fail, there are no more records than slots */
+	ring_push(&sink->queue, r, NULL);
+out:
+	pthread_mutex_unlock(&sink->lock);
+}
+
+/* Write out all queued results and close the destination */
+void sink_close(struct sink *sink)
+{
+	atomic_store(&sink->stop, 1);
+	pthread_join(sink->thread, NULL);
+
+	if (sink->error)
+		fprintf(stderr, "Error writing results, some are lost\n");
+	if (sink->dropped)
+		fprintf(stderr, "Results dropped: %lu\n", sink->dropped);
+
+	pthread_mutex_destroy(&sink->lock);
+	ring_free(&sink->queue);
+	ring_free(&sink->free_q);
+	free(sink->records);
+	free(sink->batch);
+	close(sink->fd);
+}
@@ -0,0 +1,83 @@
+/*
+ * Structured output of detection results
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "result.h"
+#include "ring.h"
+
+enum sink_format {
+	SINK_BINARY,		/* Fixed-size struct sink_record */
+	SINK_JSON,		/* One JSON object per line */
+};
+
+/*
+ * Binary record, written in host byte order. All the fields are
+ * naturally aligned, so the layout is the same on every common ABI.
+ */
+struct sink_record {
+	uint64_t	timestamp;	/* Microseconds since the epoch */
+	uint32_t	frame;		/* Frame number in the stream */
+	uint16_t	stream;		/* Index of the source */
+	uint8_t		num_fingers;
+	uint8_t		num_defects;
+	int16_t		center[2];
+	int16_t		radius;
+	int16_t		hand;		/* Index of the hand in the frame */
+	int16_t		fingers[NUM_FINGERS + 1][2];
+	int16_t		defects[NUM_DEFECTS][2];
+};
+
+/*
+ * Records are queued to a writer thread, which formats them in batches
+ * and does all the I/O, so producers never wait for the destination. If
+ * the writer falls behind and no free record is left, the new record is
+ * dropped and counted, unless the sink is lossless.
+ */
+struct sink {
+	int		fd;
+	enum sink_format format;
+	int		lossless;	/* Wait for the writer, never drop */
+
+	struct sink_record *records;
+	struct ring	queue;		/* Producers -> writer */
+	struct ring	free_q;		/* Writer -> producers */
+	pthread_mutex_t	lock;		/* Serializes producers */
+
+	char		*batch;
+	size_t		batch_len;
+
+	pthread_t	thread;
+	atomic_int	stop;
+
+	unsigned long	written;
+	unsigned long	dropped;
+	int		error;		/* Set when the destination fails */
+};
+
+int sink_open(struct sink *sink, const char *path, enum sink_format format);
+void sink_write(struct sink *sink, int stream, unsigned long frame,
+		uint64_t timestamp, int index,
+		const struct hand_result *hand);
+void sink_close(struct sink *sink);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+ * Skin color classification
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "skin.h"
+
+/* Fixed point precision used by OpenCV for 8-bit BGR to HSV */
+#define HSV_SHIFT	12
+#define HSV_ROUND	(1 << (HSV_SHIFT - 1))
+#define HUE_RANGE	180
+
+/* Constant once computed, shared by all skin models */
+static int sdiv_table[256];
+static int hdiv_table[256];
+static pthread_once_t div_tables_once = PTHREAD_ONCE_INIT;
+
+static void init_div_tables(void)
+{
+	int i;
+
+	sdiv_table[0] = hdiv_table[0] = 0;
+	for (i = 1; i < 256; i++) {
+		sdiv_table[i] = cvRound((255 << HSV_SHIFT) / (1. * i));
+		hdiv_table[i] = cvRound((HUE_RANGE << HSV_SHIFT) / (6. * i));
+	}
+}
+
+static int hsv_sat(int v, int d)
+{
+	return (d * sdiv_table[v] + HSV_ROUND) >> HSV_SHIFT;
+}
+
+static int hsv_hue(int d, int n)
+{
+	int h = (n * hdiv_table[d] + HSV_ROUND) >> HSV_SHIFT;
+
+	return h < 0 ? h + HUE_RANGE : h;
+}
+
+/*
+ * Find the contiguous range of x in [lo, hi] for which f(a, x) lies in
+ * [min, max]. Returns -1 if the matching values are not contiguous.
+ */
+static int find_range(int (*f)(int, int), int a, int lo, int hi,
+		      int min, int max, short *rmin, short *rmax)
+{
+	int x, y;
+
+	/* An empty range never matches */
+	*rmin = 1;
+	*rmax = 0;
+
+	for (x = lo; x <= hi; x++) {
+		y = f(a, x);
+		if (y < min || y > max)
+			continue;
+
+		if (*rmin > *rmax)
+			*rmin = *rmax = x;
+		else if (x == *rmax + 1)
+			*rmax = x;
+		else
+			return -1;
+	}
+
+	return 0;
+}
+
+int skin_hsv_init(struct skin_hsv *hsv, CvScalar lower, CvScalar upper)
+{
+	int i;
+
+	pthread_once(&div_tables_once, init_div_tables);
+
+	hsv->v_min = cvRound(lower.val[2]);
+	hsv->v_max = cvRound(upper.val[2]);
+
+	for (i = 0; i < 256; i++) {
+		/* d can't exceed v, and the hue numerator lies in [-d, 5d] */
+		if (find_range(hsv_sat, i, 0, i, cvRound(lower.val[1]),
+			       cvRound(upper.val[1]), &hsv->d_min[i],
+			       &hsv->d_max[i]) < 0)
+			return -1;
+		if (find_range(hsv_hue, i, -i, 5 * i, cvRound(lower.val[0]),
+			       cvRound(upper.val[0]), &hsv->n_min[i],
+			       &hsv->n_max[i]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static inline int hsv_test(const struct skin_hsv *hsv, int b, int g, int r)
+{
+	int v, vmin, d, n;
+
+	v = b > g ? b : g;
+	v = v > r ? v : r;
+	vmin = b < g ? b : g;
+	vmin = vmin < r ? vmin : r;
+	d = v - vmin;
+
+	/* Same sector selection as OpenCV, eg. red wins ties */
+	if (v == r)
+		n = g - b;
+	else if (v == g)
+		n = b - r + 2 * d;
+	else
+		n = r - g + 4 * d;
+
+	return v >= hsv->v_min && v <= hsv->v_max &&
+		d >= hsv->d_min[v] && d <= hsv->d_max[v] &&
+		n >= hsv->n_min[d] && n <= hsv->n_max[d];
+}
+
+/*
+ * Equivalent to cvCvtColor(CV_BGR2HSV) followed by cvInRangeS(), but
+ * done in a single sweep that never writes the HSV image back to memory.
+ * Both images must have the same size or ROI size.
+ */
+void skin_hsv_threshold(const struct skin_hsv *hsv, const IplImage *src,
+			IplImage *dst)
+{
+	CvRect sr = cvGetImageROI(src);
+	CvRect dr = cvGetImageROI(dst);
+	int x, y;
+
+	for (y = 0; y < sr.height; y++) {
+		const uchar *s = (const uchar *)src->imageData +
+			(sr.y + y) * src->widthStep + sr.x * 3;
+		uchar *m = (uchar *)dst->imageData +
+			(dr.y + y) * dst->widthStep + dr.x;
+
+		for (x = 0; x < sr.width; x++, s += 3)
+			m[x] = hsv_test(hsv, s[0], s[1], s[2]) ? 255 : 0;
+	}
+}
+
+static inline int lut_index(int b, int g, int r)
+{
+	int shift = 8 - SKIN_LUT_BITS;
+
+	return ((b >> shift) << (2 * SKIN_LUT_BITS)) |
+		((g >> shift) << SKIN_LUT_BITS) | (r >> shift);
+}
+
+/*
+ * Build a table approximating an HSV range: a cell is marked as skin
+ * when most of the colors it contains pass the HSV test.
+ */
+void skin_lut_from_hsv(struct skin_lut *lut, const struct skin_hsv *hsv)
+{
+	int step = 1 << (8 - SKIN_LUT_BITS);
+	int b, g, r, i, j, k, count, idx;
+
+	memset(lut->bits, 0, sizeof(lut->bits));
+
+	for (b = 0; b < 256; b += step) {
+		for (g = 0; g < 256; g += step) {
+			for (r = 0; r < 256; r += step) {
+				count = 0;
+				for (i = 0; i < step; i++)
+					for (j = 0; j < step; j++)
+						for (k = 0; k < step; k++)
+							count += hsv_test(hsv, b + i,
+									  g + j, r + k);
+
+				if (2 * count > step * step * step) {
+					idx = lut_index(b, g, r);
+					lut->bits[idx >> 3] |= 1 << (idx & 7);
+				}
+			}
+		}
+	}
+}
+
+/* Tables are stored as SKIN_LUT_SIZE raw bytes, same layout as in memory */
+int skin_lut_load(struct skin_lut *lut, const char *path)
+{
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return -1;
+
+	if (fread(lut->bits, 1, sizeof(lut->bits), f) != sizeof(lut->bits) ||
+	    fgetc(f) != EOF)
+		ret = -1;
+
+	fclose(f);
+	return ret;
+}
+
+int skin_lut_save(const struct skin_lut *lut, const char *path)
+{
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "wb");
+	if (!f)
+		return -1;
+
+	if (fwrite(lut->bits, 1, sizeof(lut->bits), f) != sizeof(lut->bits))
+		ret = -1;
+	if (fclose(f))
+		ret = -1;
+
+	return ret;
+}
+
+/* Classify BGR pixels of src into the 8-bit mask dst */
+void skin_lut_threshold(const struct skin_lut *lut, const IplImage *src,
+			IplImage *dst)
+{
+	CvRect sr = cvGetImageROI(src);
+	CvRect dr = cvGetImageROI(dst);
+	int x, y, idx;
+
+	for (y = 0; y < sr.height; y++) {
+		const uchar *s = (const uchar *)src->imageData +
+			(sr.y + y) * src->widthStep + sr.x * 3;
+		uchar *m = (uchar *)dst->imageData +
+			(dr.y + y) * dst->widthStep + dr.x;
+
+		for (x = 0; x < sr.width; x++, s += 3) {
+			idx = lut_index(s[0], s[1], s[2]);
+			m[x] = (lut->bits[idx >> 3] >> (idx & 7)) & 1 ? 255 : 0;
+		}
+	}
+}
+
+void skin_threshold(const struct skin_model *model, const IplImage *src,
+		    IplImage *dst)
+{
+	switch (model->type) {
+	case SKIN_MODEL_HSV:
+		skin_hsv_threshold(&model->hsv, src, dst);
+		break;
+	case SKIN_MODEL_LUT:
+		skin_lut_threshold(&model->lut, src, dst);
+		break;
+	}
+}
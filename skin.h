@@ -0,0 +1,78 @@
+/*
+ * Skin color classification
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef SKIN_H
+#define SKIN_H
+
+#include <opencv2/core/core_c.h>
+
+/*
+ * Precomputed form of an inclusive HSV range, as accepted by
+ * cvInRangeS() on the output of cvCvtColor(CV_BGR2HSV).
+ *
+ * For a BGR pixel let v = max(b, g, r) and d = v - min(b, g, r). OpenCV
+ * derives S from (v, d) and H from (d, n), where n is the hue numerator
+ * of the sector containing the pixel. Both are monotonic in the second
+ * argument, so each range test becomes a pair of integer comparisons
+ * against bounds that are computed once with the exact OpenCV rounding.
+ */
+struct skin_hsv {
+	int		v_min;
+	int		v_max;
+	short		d_min[256];	/* Range of d giving a valid S, per v */
+	short		d_max[256];
+	short		n_min[256];	/* Range of n giving a valid H, per d */
+	short		n_max[256];
+};
+
+/*
+ * Quantized BGR to skin lookup table: one bit for each color, with 5
+ * bits per channel. At 4KB it stays in L1 cache during classification
+ * and can be loaded from a file to use calibrated skin models.
+ */
+#define SKIN_LUT_BITS	5
+#define SKIN_LUT_SIZE	((1 << (3 * SKIN_LUT_BITS)) / 8)
+
+struct skin_lut {
+	uchar		bits[SKIN_LUT_SIZE];
+};
+
+enum skin_model_type {
+	SKIN_MODEL_HSV,		/* Exact HSV range test */
+	SKIN_MODEL_LUT,		/* Lookup table on raw BGR */
+};
+
+struct skin_model {
+	enum skin_model_type	type;
+	struct skin_hsv		hsv;
+	struct skin_lut		lut;
+};
+
+int skin_hsv_init(struct skin_hsv *hsv, CvScalar lower, CvScalar upper);
+void skin_hsv_threshold(const struct skin_hsv *hsv, const IplImage *src,
+			IplImage *dst);
+
+void skin_lut_from_hsv(struct skin_lut *lut, const struct skin_hsv *hsv);
+int skin_lut_load(struct skin_lut *lut, const char *path);
+int skin_lut_save(const struct skin_lut *lut, const char *path);
+void skin_lut_threshold(const struct skin_lut *lut, const IplImage *src,
+			IplImage *dst);
+
+void skin_threshold(const struct skin_model *model, const IplImage *src,
+		    IplImage *dst);
+
+#endif
@@ -0,0 +1,664 @@
+/*
+ * Frame sources
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <linux/dma-buf.h>
+#include <linux/videodev2.h>
+
+#include <opencv2/highgui/highgui_c.h>
+
+#include "source.h"
+
+#define V4L2_BUFFERS	4
+
+/* A shared memory producer silent for that long is gone */
+#define SHM_TIMEOUT_US	5000000
+#define SHM_POLL_US	500
+
+struct source_ops {
+	int	(*next)(struct source *src, struct source_frame *frame);
+	void	(*close)(struct source *src);
+};
+
+static int xioctl(int fd, unsigned long req, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, req, arg);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+/*
+ * OpenCV captures decode into a buffer of their own, which is reused by
+ * the next call, so there is nothing to release.
+ */
+struct cv_source {
+	struct source	src;
+	CvCapture	*capture;
+};
+
+static int cv_next(struct source *src, struct source_frame *frame)
+{
+	struct cv_source *cv = (struct cv_source *)src;
+	IplImage *image;
+
+	image = cvQueryFrame(cv->capture);
+	if (!image)
+		return -1;
+
+	frame->image.data = (unsigned char *)image->imageData;
+	frame->image.width = image->width;
+	frame->image.height = image->height;
+	frame->image.stride = image->widthStep;
+	frame->timestamp = 0;
+	frame->release = NULL;
+	return 0;
+}
+
+static void cv_close(struct source *src)
+{
+	struct cv_source *cv = (struct cv_source *)src;
+
+	cvReleaseCapture(&cv->capture);
+	free(cv);
+}
+
+static const struct source_ops cv_ops = {
+	.next	= cv_next,
+	.close	= cv_close,
+};
+
+/* Sources made only of digits are camera indices */
+static int is_camera(const char *name)
+{
+	for (; *name; name++)
+		if (!isdigit((unsigned char)*name))
+			return 0;
+
+	return 1;
+}
+
+static struct source *open_cv(const char *name)
+{
+	struct cv_source *cv;
+
+	cv = calloc(1, sizeof(*cv));
+	if (!cv)
+		return NULL;
+
+	if (is_camera(name))
+		cv->capture = cvCaptureFromCAM(atoi(name));
+	else
+		cv->capture = cvCaptureFromFile(name);
+	if (!cv->capture) {
+		free(cv);
+		return NULL;
+	}
+
+	cv->src.ops = &cv_ops;
+	cv->src.width = cvGetCaptureProperty(cv->capture,
+					     CV_CAP_PROP_FRAME_WIDTH);
+	cv->src.height = cvGetCaptureProperty(cv->capture,
+					      CV_CAP_PROP_FRAME_HEIGHT);
+	cv->src.fps = cvGetCaptureProperty(cv->capture, CV_CAP_PROP_FPS);
+	if (cv->src.fps < 0)
+		cv->src.fps = 0;
+
+	return &cv->src;
+}
+
+/*
+ * The producer can write the whole mapping, so the geometry is copied
+ * once, validated, and never read from the header again
+ */
+struct shm_source {
+	struct source	src;
+	struct shm_header *header;
+	size_t		size;
+	unsigned int	next;		/* Sequence of the next frame */
+
+	uint32_t	width;
+	uint32_t	height;
+	uint32_t	stride;
+	uint32_t	num_slots;
+	uint32_t	slot_size;
+	uint64_t	data_offset;
+};
+
+static void shm_release(struct source_frame *frame)
+{
+	struct shm_source *shm = (struct shm_source *)frame->src;
+
+	/* Publishes that we are done reading the slot */
+	atomic_fetch_add_explicit(&shm->header->tail, 1,
+				  memory_order_release);
+}
+
+static int shm_next(struct source *src, struct source_frame *frame)
+{
+	struct shm_source *shm = (struct shm_source *)src;
+	struct shm_header *h = shm->header;
+	unsigned int slot;
+	long waited = 0;
+
+	while (atomic_load_explicit(&h->head, memory_order_acquire) ==
+	       shm->next) {
+		if (atomic_load(&h->closed) || waited >= SHM_TIMEOUT_US)
+			return -1;
+		usleep(SHM_POLL_US);
+		waited += SHM_POLL_US;
+	}
+
+	slot = shm->next++ % shm->num_slots;
+
+	frame->image.data = (unsigned char *)h + shm->data_offset +
+		(size_t)slot * shm->slot_size;
+	frame->image.width = shm->width;
+	frame->image.height = shm->height;
+	frame->image.stride = shm->stride;
+	frame->timestamp = h->timestamps[slot];
+	frame->release = shm_release;
+	frame->src = src;
+	frame->buffer = slot;
+	return 0;
+}
+
+static void shm_close(struct source *src)
+{
+	struct shm_source *shm = (struct shm_source *)src;
+
+	munmap(shm->header, shm->size);
+	free(shm);
+}
+
+static const struct source_ops shm_ops = {
+	.next	= shm_next,
+	.close	= shm_close,
+};
+
+/* Check the geometry copied from the header against the mapping */
+static int shm_valid(const struct shm_source *shm)
+{
+	size_t header = sizeof(struct shm_header) +
+		(size_t)shm->num_slots * sizeof(shm->header->timestamps[0]);
+
+	return shm->num_slots && shm->width && shm->height &&
+		shm->stride >= 3 * (size_t)shm->width &&
+		shm->slot_size >= (size_t)shm->stride * shm->height &&
+		shm->data_offset >= header && shm->data_offset <= shm->size &&
+		(shm->size - shm->data_offset) / shm->num_slots >=
+		shm->slot_size;
+}
+
+static struct source *open_shm(const char *name)
+{
+	struct shm_source *shm;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 ||
+	    (size_t)st.st_size < sizeof(struct shm_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	shm->header = map;
+	shm->size = st.st_size;
+	shm->width = shm->header->width;
+	shm->height = shm->header->height;
+	shm->stride = shm->header->stride;
+	shm->num_slots = shm->header->num_slots;
+	shm->slot_size = shm->header->slot_size;
+	shm->data_offset = shm->header->data_offset;
+	if (shm->header->magic != SHM_MAGIC || !shm_valid(shm)) {
+		free(shm);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	shm->src.ops = &shm_ops;
+	shm->src.width = shm->width;
+	shm->src.height = shm->height;
+	/* Start after the frames already released by a previous reader */
+	shm->next = atomic_load(&shm->header->tail);
+
+	return &shm->src;
+}
+
+/*
+ * V4L2 buffers are mapped once and queued back to the driver when the
+ * frame is released. The device must capture BGR24, as converting would
+ * mean a copy.
+ */
+struct v4l2_source {
+	struct source	src;
+	int		fd;
+	struct {
+		void	*start;
+		size_t	length;
+	} buffers[V4L2_BUFFERS];
+	unsigned int	num_buffers;
+	int		stride;		/* Bytes per line */
+};
+
+/* V4L2 timestamps are on the monotonic clock, results use the epoch */
+static uint64_t v4l2_timestamp(const struct v4l2_buffer *buf)
+{
+	struct timespec mono, real;
+	int64_t offset;
+
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) !=
+	    V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	offset = (int64_t)(real.tv_sec - mono.tv_sec) * 1000000 +
+		(real.tv_nsec - mono.tv_nsec) / 1000;
+
+	return (uint64_t)buf->timestamp.tv_sec * 1000000 +
+		buf->timestamp.tv_usec + offset;
+}
+
+static int v4l2_queue(struct v4l2_source *v, unsigned int index)
+{
+	struct v4l2_buffer buf = {
+		.type	= V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory	= V4L2_MEMORY_MMAP,
+		.index	= index,
+	};
+
+	return xioctl(v->fd, VIDIOC_QBUF, &buf);
+}
+
+static void v4l2_release(struct source_frame *frame)
+{
+	v4l2_queue((struct v4l2_source *)frame->src, frame->buffer);
+}
+
+static int v4l2_next(struct source *src, struct source_frame *frame)
+{
+	struct v4l2_source *v = (struct v4l2_source *)src;
+	struct v4l2_buffer buf = {
+		.type	= V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory	= V4L2_MEMORY_MMAP,
+	};
+
+	for (;;) {
+		if (xioctl(v->fd, VIDIOC_DQBUF, &buf) < 0)
+			return -1;
+		if (!(buf.flags & V4L2_BUF_FLAG_ERROR))
+			break;
+
+		/* Drop corrupted frames instead of detecting on them */
+		if (v4l2_queue(v, buf.index) < 0)
+			return -1;
+	}
+
+	frame->image.data = v->buffers[buf.index].start;
+	frame->image.width = src->width;
+	frame->image.height = src->height;
+	frame->image.stride = v->stride;
+	frame->timestamp = v4l2_timestamp(&buf);
+	frame->release = v4l2_release;
+	frame->src = src;
+	frame->buffer = buf.index;
+	return 0;
+}
+
+static void v4l2_close(struct source *src)
+{
+	struct v4l2_source *v = (struct v4l2_source *)src;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	unsigned int i;
+
+	xioctl(v->fd, VIDIOC_STREAMOFF, &type);
+	for (i = 0; i < v->num_buffers; i++)
+		munmap(v->buffers[i].start, v->buffers[i].length);
+	close(v->fd);
+	free(v);
+}
+
+static const struct source_ops v4l2_ops = {
+	.next	= v4l2_next,
+	.close	= v4l2_close,
+};
+
+static int v4l2_setup(struct v4l2_source *v)
+{
+	struct v4l2_format fmt = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE };
+	struct v4l2_streamparm parm = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE };
+	struct v4l2_requestbuffers req = {
+		.count	= V4L2_BUFFERS,
+		.type	= V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory	= V4L2_MEMORY_MMAP,
+	};
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct v4l2_fract *tpf = &parm.parm.capture.timeperframe;
+	unsigned int i;
+
+	if (xioctl(v->fd, VIDIOC_G_FMT, &fmt) < 0)
+		return -1;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_BGR24;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (xioctl(v->fd, VIDIOC_S_FMT, &fmt) < 0 ||
+	    fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_BGR24 ||
+	    fmt.fmt.pix.bytesperline < 3 * fmt.fmt.pix.width)
+		return -1;
+
+	v->src.width = fmt.fmt.pix.width;
+	v->src.height = fmt.fmt.pix.height;
+	v->stride = fmt.fmt.pix.bytesperline;
+	if (!xioctl(v->fd, VIDIOC_G_PARM, &parm) && tpf->numerator)
+		v->src.fps = (double)tpf->denominator / tpf->numerator;
+
+	if (xioctl(v->fd, VIDIOC_REQBUFS, &req) < 0 || !req.count)
+		return -1;
+
+	for (i = 0; i < req.count && i < V4L2_BUFFERS; i++) {
+		struct v4l2_buffer buf = {
+			.type	= V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			.memory	= V4L2_MEMORY_MMAP,
+			.index	= i,
+		};
+		void *start;
+
+		if (xioctl(v->fd, VIDIOC_QUERYBUF, &buf) < 0)
+			return -1;
+
+		if (buf.length < (size_t)v->stride * v->src.height)
+			return -1;
+
+		start = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, v->fd,
+			     buf.m.offset);
+		if (start == MAP_FAILED)
+			return -1;
+
+		v->buffers[i].start = start;
+		v->buffers[i].length = buf.length;
+		v->num_buffers++;
+
+		if (v4l2_queue(v, i) < 0)
+			return -1;
+	}
+
+	return xioctl(v->fd, VIDIOC_STREAMON, &type);
+}
+
+static struct source *open_v4l2(const char *device)
+{
+	struct v4l2_source *v;
+
+	v = calloc(1, sizeof(*v));
+	if (!v)
+		return NULL;
+
+	v->src.ops = &v4l2_ops;
+	v->fd = open(device, O_RDWR);
+	if (v->fd < 0) {
+		free(v);
+		return NULL;
+	}
+
+	if (v4l2_setup(v) < 0) {
+		v4l2_close(&v->src);
+		return NULL;
+	}
+
+	return &v->src;
+}
+
+/*
+ * DMA-BUF buffers are mapped when their descriptor first arrives and
+ * kept mapped while the producer reuses them. CPU access is bracketed
+ * by DMA_BUF_IOCTL_SYNC, so caches are coherent with the device.
+ */
+struct dmabuf_source {
+	struct source	src;
+	int		sock;
+	struct {
+		int	fd;
+		void	*map;
+		size_t	size;
+	} buffers[DMABUF_BUFFERS];
+};
+
+static void dmabuf_sync(int fd, uint64_t flags)
+{
+	struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+
+	xioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+static void dmabuf_unmap(struct dmabuf_source *d, unsigned int i)
+{
+	if (d->buffers[i].map)
+		munmap(d->buffers[i].map, d->buffers[i].size);
+	if (d->buffers[i].fd >= 0)
+		close(d->buffers[i].fd);
+	d->buffers[i].map = NULL;
+	d->buffers[i].fd = -1;
+}
+
+static void dmabuf_release(struct source_frame *frame)
+{
+	struct dmabuf_source *d = (struct dmabuf_source *)frame->src;
+	uint32_t buffer = frame->buffer;
+
+	dmabuf_sync(d->buffers[buffer].fd, DMA_BUF_SYNC_END);
+	send(d->sock, &buffer, sizeof(buffer), MSG_NOSIGNAL);
+}
+
+/* Receive a frame message, and the descriptor sent with it if any */
+static int dmabuf_recv(struct dmabuf_source *d, struct dmabuf_msg *msg,
+		       int *fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+	struct msghdr mh = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= control,
+		.msg_controllen	= sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	do {
+		n = recvmsg(d->sock, &mh, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+
+	*fd = -1;
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (n > 0 && cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(*fd));
+
+	if (n != sizeof(*msg) || msg->buffer >= DMABUF_BUFFERS) {
+		if (*fd >= 0)
+			close(*fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int dmabuf_next(struct source *src, struct source_frame *frame)
+{
+	struct dmabuf_source *d = (struct dmabuf_source *)src;
+	struct dmabuf_msg msg;
+	uint64_t size;
+	off_t end;
+	void *map;
+	int fd;
+
+	if (dmabuf_recv(d, &msg, &fd) < 0)
+		return -1;
+
+	if (fd >= 0) {
+		/* New buffer, or the producer reallocated it */
+		dmabuf_unmap(d, msg.buffer);
+		d->buffers[msg.buffer].fd = fd;
+
+		/* Map what the exporter allocated, not what the message says */
+		end = lseek(fd, 0, SEEK_END);
+		if (end <= 0)
+			return -1;
+
+		map = mmap(NULL, end, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			return -1;
+		d->buffers[msg.buffer].map = map;
+		d->buffers[msg.buffer].size = end;
+	}
+
+	size = msg.offset + (uint64_t)msg.stride * msg.height;
+
+	if (!d->buffers[msg.buffer].map ||
+	    size > d->buffers[msg.buffer].size ||
+	    !msg.width || !msg.height ||
+	    msg.stride < 3 * (uint64_t)msg.width)
+		return -1;
+
+	dmabuf_sync(d->buffers[msg.buffer].fd, DMA_BUF_SYNC_START);
+
+	/* Only known once the producer starts sending */
+	src->width = msg.width;
+	src->height = msg.height;
+
+	frame->image.data = (unsigned char *)d->buffers[msg.buffer].map +
+		msg.offset;
+	frame->image.width = msg.width;
+	frame->image.height = msg.height;
+	frame->image.stride = msg.stride;
+	frame->timestamp = msg.timestamp;
+	frame->release = dmabuf_release;
+	frame->src = src;
+	frame->buffer = msg.buffer;
+	return 0;
+}
+
+static void dmabuf_close(struct source *src)
+{
+	struct dmabuf_source *d = (struct dmabuf_source *)src;
+	unsigned int i;
+
+	for (i = 0; i < DMABUF_BUFFERS; i++)
+		dmabuf_unmap(d, i);
+	close(d->sock);
+	free(d);
+}
+
+static const struct source_ops dmabuf_ops = {
+	.next	= dmabuf_next,
+	.close	= dmabuf_close,
+};
+
+static struct source *open_dmabuf(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct dmabuf_source *d;
+	unsigned int i;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return NULL;
+	strcpy(addr.sun_path, path);
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+	for (i = 0; i < DMABUF_BUFFERS; i++)
+		d->buffers[i].fd = -1;
+
+	d->src.ops = &dmabuf_ops;
+	d->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (d->sock < 0) {
+		free(d);
+		return NULL;
+	}
+
+	if (connect(d->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		dmabuf_close(&d->src);
+		return NULL;
+	}
+
+	return &d->src;
+}
+
+struct source *source_open(const char *name)
+{
+	if (!strncmp(name, SHM_PREFIX, strlen(SHM_PREFIX)))
+		return open_shm(name + strlen(SHM_PREFIX));
+
+	if (!strncmp(name, V4L2_PREFIX, strlen(V4L2_PREFIX)))
+		return open_v4l2(name + strlen(V4L2_PREFIX));
+
+	if (!strncmp(name, DMABUF_PREFIX, strlen(DMABUF_PREFIX)))
+		return open_dmabuf(name + strlen(DMABUF_PREFIX));
+
+	return open_cv(name);
+}
+
+/* Get the next frame, -1 at the end of the stream or on errors */
+int source_next(struct source *src, struct source_frame *frame)
+{
+	return src->ops->next(src, frame);
+}
+
+void source_release(struct source_frame *frame)
+{
+	if (frame->release)
+		frame->release(frame);
+	frame->release = NULL;
+}
+
+void source_close(struct source *src)
+{
+	if (src)
+		src->ops->close(src);
+}
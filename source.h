@@ -0,0 +1,113 @@
+/*
+ * Frame sources
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "detector.h"
+
+/*
+ * A source hands out frames that stay in the buffers it got them in, so
+ * that the detector reads the pixels in place. Each frame is owned by
+ * the caller until source_release() gives the buffer back; frames must
+ * be released in the order they were returned. OpenCV captures decode
+ * into a buffer of their own, so their frames are only valid until the
+ * next call to source_next().
+ *
+ * Source names are:
+ *   N              camera index, through OpenCV
+ *   shm:NAME       POSIX shared memory ring, see struct shm_header
+ *   v4l2:DEVICE    V4L2 capture device, with mmap buffers
+ *   dmabuf:SOCKET  DMA-BUF file descriptors received over a UNIX socket
+ * Anything else is opened by OpenCV as a file name or URL. All sources
+ * deliver 8-bit BGR pixels.
+ */
+struct source_ops;
+
+struct source {
+	const struct source_ops	*ops;
+	int		width;
+	int		height;
+	double		fps;		/* Zero if unknown */
+};
+
+struct source_frame {
+	struct hand_frame image;
+	uint64_t	timestamp;	/* Capture time in us, zero if unknown */
+
+	/* Gives the buffer back to its owner */
+	void		(*release)(struct source_frame *frame);
+	struct source	*src;
+	unsigned int	buffer;		/* Index of the buffer in the source */
+};
+
+#define SHM_PREFIX	"shm:"
+#define V4L2_PREFIX	"v4l2:"
+#define DMABUF_PREFIX	"dmabuf:"
+
+#define SHM_MAGIC	0x444e4148	/* "HAND" in little endian */
+
+/*
+ * Layout of a shared memory source, created by the producer. Slot i is
+ * at data_offset + i * slot_size and its capture time is timestamps[i].
+ * The producer fills slot head % num_slots and then increments head; the
+ * consumer increments tail when it releases a slot, and the producer
+ * must not reuse a slot until then. Both counters only grow, so the
+ * frames ready are head - tail.
+ */
+struct shm_header {
+	uint32_t	magic;
+	uint32_t	width;
+	uint32_t	height;
+	uint32_t	stride;
+	uint32_t	num_slots;
+	uint32_t	slot_size;
+	uint64_t	data_offset;
+	atomic_uint	head;
+	atomic_uint	tail;
+	atomic_uint	closed;		/* Set by the producer at the end */
+	uint32_t	reserved;
+	uint64_t	timestamps[];
+};
+
+/*
+ * Message sent by a DMA-BUF producer over a SOCK_SEQPACKET socket for
+ * each frame. The buffer file descriptor is attached as SCM_RIGHTS the
+ * first time a buffer is sent, or when it changed. The consumer answers
+ * with the buffer index, as a uint32_t, when the frame is released.
+ */
+struct dmabuf_msg {
+	uint32_t	buffer;		/* Below DMABUF_BUFFERS */
+	uint32_t	width;
+	uint32_t	height;
+	uint32_t	stride;
+	uint32_t	offset;		/* Of the first pixel in the buffer */
+	uint32_t	reserved;
+	uint64_t	timestamp;
+};
+
+#define DMABUF_BUFFERS	16
+
+struct source *source_open(const char *name);
+int source_next(struct source *src, struct source_frame *frame);
+void source_release(struct source_frame *frame);
+void source_close(struct source *src);
+
+#endif
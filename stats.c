@@ -0,0 +1,179 @@
+/*
+ * Per-stage latency statistics
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "stats.h"
+
+#if defined(ENABLE_STATS)
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Log-linear histogram of nanoseconds: values are grouped by their most
+ * significant bit, and each power of two is split into HIST_SUB linear
+ * buckets, which bounds the relative error of quantiles to 1/HIST_SUB.
+ */
+#define HIST_SUB_BITS	3
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(64 * HIST_SUB)
+
+struct histogram {
+	atomic_ulong	count[HIST_BUCKETS];
+	atomic_ulong	total;
+	atomic_ullong	max;
+};
+
+static struct histogram hist[NUM_STAGES];
+static atomic_ulong dropped;
+
+static const char *stage_names[NUM_STAGES] = {
+	[STAGE_FILTER]	= "filter",
+	[STAGE_CONTOUR]	= "contour",
+	[STAGE_HULL]	= "hull",
+	[STAGE_FINGERS]	= "fingers",
+	[STAGE_DISPLAY]	= "display",
+	[STAGE_RECORD]	= "record",
+	[STAGE_FRAME]	= "frame",
+};
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t v)
+{
+	int msb;
+
+	if (v < HIST_SUB)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+		((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Upper bound of the values falling in a bucket */
+static uint64_t bucket_max(int b)
+{
+	int msb;
+
+	if (b < HIST_SUB)
+		return b;
+
+	msb = b / HIST_SUB + HIST_SUB_BITS - 1;
+	return ((uint64_t)(HIST_SUB + b % HIST_SUB + 1) <<
+		(msb - HIST_SUB_BITS)) - 1;
+}
+
+void stats_add(enum stats_stage stage, uint64_t ns)
+{
+	struct histogram *h = &hist[stage];
+	unsigned long long max;
+
+	atomic_fetch_add_explicit(&h->count[bucket_of(ns)], 1,
+				  memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+
+	max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	while (ns > max &&
+	       !atomic_compare_exchange_weak_explicit(&h->max, &max, ns,
+						      memory_order_relaxed,
+						      memory_order_relaxed))
+		;
+}
+
+void stats_drop(unsigned long frames)
+{
+	atomic_fetch_add_explicit(&dropped, frames, memory_order_relaxed);
+}
+
+static double quantile(struct histogram *h, unsigned long total, double q)
+{
+	unsigned long seen = 0, rank = q * total;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += atomic_load_explicit(&h->count[b],
+					     memory_order_relaxed);
+		if (seen > rank)
+			break;
+	}
+
+	return bucket_max(b < HIST_BUCKETS ? b : HIST_BUCKETS - 1) / 1e6;
+}
+
+/* Print milliseconds spent in each stage since startup */
+void stats_print(void)
+{
+	unsigned long total;
+	int i;
+
+	fprintf(stderr, "%-8s %10s %9s %9s %9s %9s\n", "stage", "count",
+		"p50 ms", "p95 ms", "p99 ms", "max ms");
+
+	for (i = 0; i < NUM_STAGES; i++) {
+		total = atomic_load_explicit(&hist[i].total,
+					     memory_order_relaxed);
+		if (!total)
+			continue;
+
+		fprintf(stderr, "%-8s %10lu %9.3f %9.3f %9.3f %9.3f\n",
+			stage_names[i], total, quantile(&hist[i], total, 0.50),
+			quantile(&hist[i], total, 0.95),
+			quantile(&hist[i], total, 0.99),
+			atomic_load_explicit(&hist[i].max,
+					     memory_order_relaxed) / 1e6);
+	}
+
+	fprintf(stderr, "dropped frames: %lu\n", atomic_load(&dropped));
+}
+
+static void *reporter_thread(void *arg)
+{
+	int interval = (long)arg;
+
+	for (;;) {
+		sleep(interval);
+		stats_print();
+	}
+
+	return NULL;
+}
+
+/* Print statistics on stderr every interval seconds */
+int stats_start_reporter(int interval)
+{
+	pthread_t thread;
+
+	if (interval <= 0)
+		return 0;
+
+	if (pthread_create(&thread, NULL, reporter_thread,
+			   (void *)(long)interval))
+		return -1;
+
+	return pthread_detach(thread);
+}
+
+#endif
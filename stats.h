@@ -0,0 +1,67 @@
+/*
+ * Per-stage latency statistics
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+enum stats_stage {
+	STAGE_FILTER,
+	STAGE_CONTOUR,
+	STAGE_HULL,
+	STAGE_FINGERS,
+	STAGE_DISPLAY,
+	STAGE_RECORD,
+	STAGE_FRAME,		/* Whole frame, capture excluded */
+	NUM_STAGES,
+};
+
+/*
+ * Latency histograms, shared by all threads and updated with relaxed
+ * atomic increments only. Build with -DENABLE_STATS (make STATS=1) to
+ * enable them: otherwise the macros below expand to the bare statement
+ * and no clock is ever read.
+ */
+#if defined(ENABLE_STATS)
+
+uint64_t stats_now(void);
+void stats_add(enum stats_stage stage, uint64_t ns);
+void stats_drop(unsigned long frames);
+void stats_print(void);
+int stats_start_reporter(int interval);
+
+#define STATS_TIME(stage, stmt)						\
+	do {								\
+		uint64_t __start = stats_now();				\
+		stmt;							\
+		stats_add(stage, stats_now() - __start);		\
+	} while (0)
+
+#define STATS_DROP(frames)	stats_drop(frames)
+
+#else
+
+#define STATS_TIME(stage, stmt)	do { stmt; } while (0)
+#define STATS_DROP(frames)	do { } while (0)
+
+static inline void stats_print(void) { }
+static inline int stats_start_reporter(int interval) { return 0; }
+
+#endif
+
+#endif
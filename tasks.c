@@ -0,0 +1,124 @@
+/*
+ * Persistent pool of threads for data-parallel stages
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tasks.h"
+
+/* Run tasks of the current batch until none is left, with the lock held */
+static void run_tasks(struct task_pool *pool)
+{
+	int index;
+
+	while (pool->next < pool->count) {
+		index = pool->next++;
+
+		pthread_mutex_unlock(&pool->lock);
+		pool->fn(pool->arg, index);
+		pthread_mutex_lock(&pool->lock);
+
+		if (!--pool->pending)
+			pthread_cond_broadcast(&pool->done_cond);
+	}
+}
+
+static void *task_thread(void *arg)
+{
+	struct task_pool *pool = arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->batch == seen)
+			pthread_cond_wait(&pool->start_cond, &pool->lock);
+		if (pool->stop)
+			break;
+
+		seen = pool->batch;
+		run_tasks(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+int task_pool_init(struct task_pool *pool, int num_threads)
+{
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+
+	pool->threads = calloc(num_threads, sizeof(*pool->threads));
+	if (num_threads && !pool->threads)
+		return -1;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, task_thread,
+				   pool)) {
+			task_pool_free(pool);
+			return -1;
+		}
+		pool->num_threads++;
+	}
+
+	return 0;
+}
+
+void task_pool_free(struct task_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	pool->threads = NULL;
+}
+
+/* Run fn(arg, i) for i from 0 to count - 1 and wait for all of them */
+void task_pool_run(struct task_pool *pool, task_fn fn, void *arg,
+		   int count)
+{
+	pthread_mutex_lock(&pool->lock);
+
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->count = count;
+	pool->next = 0;
+	pool->pending = count;
+	pool->batch++;
+	pthread_cond_broadcast(&pool->start_cond);
+
+	run_tasks(pool);
+	while (pool->pending)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+
+	pthread_mutex_unlock(&pool->lock);
+}
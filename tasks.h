@@ -0,0 +1,54 @@
+/*
+ * Persistent pool of threads for data-parallel stages
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef TASKS_H
+#define TASKS_H
+
+#include <pthread.h>
+
+typedef void (*task_fn)(void *arg, int index);
+
+/*
+ * Threads created once and woken for each batch of tasks, so that a
+ * per-frame stage pays a wakeup rather than a thread creation. The
+ * calling thread runs tasks too, and task_pool_run() returns once all
+ * the tasks of the batch are done.
+ */
+struct task_pool {
+	pthread_t	*threads;
+	int		num_threads;	/* Besides the calling thread */
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	start_cond;	/* A batch is posted, or stop */
+	pthread_cond_t	done_cond;	/* The last task of a batch ended */
+
+	task_fn		fn;
+	void		*arg;
+	int		count;		/* Tasks in the batch */
+	int		next;		/* First task not taken */
+	int		pending;	/* Tasks not finished */
+	unsigned long	batch;		/* Batches posted so far */
+	int		stop;
+};
+
+int task_pool_init(struct task_pool *pool, int num_threads);
+void task_pool_free(struct task_pool *pool);
+
+void task_pool_run(struct task_pool *pool, task_fn fn, void *arg,
+		   int count);
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * Temporal filtering of detection results
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <string.h>
+
+#include "tracker.h"
+
+/*
+ * Process noise is a random acceleration of about 2 pixels per frame
+ * squared, measurement noise a few pixels. Fingertips come from the
+ * contour and jitter more than the center, which averages defects.
+ */
+#define TRACKER_ACCEL		4.0f
+#define TRACKER_NOISE		16.0f
+#define TRACKER_FINGER_NOISE	36.0f
+
+/* Tracks start with a velocity this uncertain, in pixels per frame */
+#define TRACKER_VEL_VAR		100.0f
+
+static void kalman_init(struct kalman *k, float pos, float noise)
+{
+	k->pos = pos;
+	k->vel = 0;
+	k->p00 = noise;
+	k->p01 = 0;
+	k->p11 = TRACKER_VEL_VAR;
+}
+
+static void kalman_predict(struct kalman *k)
+{
+	/* x = F x, P = F P F' + Q, with F = [1 1; 0 1] */
+	k->pos += k->vel;
+	k->p00 += 2 * k->p01 + k->p11 + TRACKER_ACCEL / 4;
+	k->p01 += k->p11 + TRACKER_ACCEL / 2;
+	k->p11 += TRACKER_ACCEL;
+}
+
+static void kalman_correct(struct kalman *k, float z, float noise)
+{
+	float s = k->p00 + noise;
+	float k0 = k->p00 / s, k1 = k->p01 / s;
+	float y = z - k->pos;
+
+	k->pos += k0 * y;
+	k->vel += k1 * y;
+
+	/* P = (I - K H) P, with H = [1 0] */
+	k->p11 -= k1 * k->p01;
+	k->p01 -= k0 * k->p01;
+	k->p00 -= k0 * k->p00;
+}
+
+void tracker_reset(struct tracker *t)
+{
+	t->valid = 0;
+}
+
+void tracker_predict(struct tracker *t)
+{
+	int i;
+
+	if (!t->valid)
+		return;
+
+	kalman_predict(&t->center[0]);
+	kalman_predict(&t->center[1]);
+	kalman_predict(&t->radius);
+	for (i = 0; i < t->num_fingers; i++) {
+		kalman_predict(&t->fingers[i][0]);
+		kalman_predict(&t->fingers[i][1]);
+	}
+}
+
+static void init_fingers(struct tracker *t, const struct hand_result *hand)
+{
+	int i;
+
+	t->num_fingers = hand->num_fingers;
+	for (i = 0; i < hand->num_fingers; i++) {
+		kalman_init(&t->fingers[i][0], hand->fingers[i].x,
+			    TRACKER_FINGER_NOISE);
+		kalman_init(&t->fingers[i][1], hand->fingers[i].y,
+			    TRACKER_FINGER_NOISE);
+	}
+}
+
+/* Greedily pair each tracked fingertip with the nearest measured one */
+static void correct_fingers(struct tracker *t, const struct hand_result *hand)
+{
+	int used[NUM_FINGERS + 1] = { 0 };
+	int i, j, best;
+	float dx, dy, d, min;
+
+	for (i = 0; i < t->num_fingers; i++) {
+		best = -1;
+		min = 0;
+		for (j = 0; j < hand->num_fingers; j++) {
+			if (used[j])
+				continue;
+			dx = hand->fingers[j].x - t->fingers[i][0].pos;
+			dy = hand->fingers[j].y - t->fingers[i][1].pos;
+			d = dx * dx + dy * dy;
+			if (best < 0 || d < min) {
+				best = j;
+				min = d;
+			}
+		}
+
+		used[best] = 1;
+		kalman_correct(&t->fingers[i][0], hand->fingers[best].x,
+			       TRACKER_FINGER_NOISE);
+		kalman_correct(&t->fingers[i][1], hand->fingers[best].y,
+			       TRACKER_FINGER_NOISE);
+	}
+}
+
+/* Update the estimate with a detected hand, after tracker_predict() */
+void tracker_correct(struct tracker *t, const struct hand_result *hand)
+{
+	t->last = *hand;
+
+	if (!t->valid) {
+		kalman_init(&t->center[0], hand->center.x, TRACKER_NOISE);
+		kalman_init(&t->center[1], hand->center.y, TRACKER_NOISE);
+		kalman_init(&t->radius, hand->radius, TRACKER_NOISE);
+		init_fingers(t, hand);
+		t->valid = 1;
+		return;
+	}
+
+	kalman_correct(&t->center[0], hand->center.x, TRACKER_NOISE);
+	kalman_correct(&t->center[1], hand->center.y, TRACKER_NOISE);
+	kalman_correct(&t->radius, hand->radius, TRACKER_NOISE);
+
+	if (hand->num_fingers != t->num_fingers)
+		init_fingers(t, hand);
+	else
+		correct_fingers(t, hand);
+}
+
+CvPoint tracker_center(const struct tracker *t)
+{
+	return cvPoint(cvRound(t->center[0].pos), cvRound(t->center[1].pos));
+}
+
+/* Current estimate, the last measurement moved along with the center */
+void tracker_result(const struct tracker *t, struct hand_result *hand)
+{
+	CvPoint c = tracker_center(t);
+	int i, dx, dy;
+
+	*hand = t->last;
+	if (!t->valid)
+		return;
+
+	dx = c.x - t->last.center.x;
+	dy = c.y - t->last.center.y;
+
+	hand->center = c;
+	hand->radius = MAX(cvRound(t->radius.pos), 0);
+	for (i = 0; i < t->num_fingers; i++)
+		hand->fingers[i] = cvPoint(cvRound(t->fingers[i][0].pos),
+					   cvRound(t->fingers[i][1].pos));
+	for (i = 0; i < hand->num_defects; i++) {
+		hand->defects[i].x += dx;
+		hand->defects[i].y += dy;
+	}
+}
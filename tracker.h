@@ -0,0 +1,51 @@
+/*
+ * Temporal filtering of detection results
+ *
+ * (C) Copyright 2012-2013 <b.galvani@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef TRACKER_H
+#define TRACKER_H
+
+#include "result.h"
+
+/* Constant velocity Kalman filter of one coordinate, one step a frame */
+struct kalman {
+	float		pos;
+	float		vel;
+	float		p00, p01, p11;	/* Covariance of (pos, vel) */
+};
+
+/*
+ * Filters the center, radius and fingertips of a hand independently,
+ * per coordinate. Fingertips are matched to the tracked ones by
+ * distance; when their number changes, they start over from the
+ * measurement. Defects are not filtered, they move with the center.
+ */
+struct tracker {
+	int		valid;		/* A hand is being tracked */
+	struct kalman	center[2];
+	struct kalman	radius;
+	struct kalman	fingers[NUM_FINGERS + 1][2];
+	int		num_fingers;
+	struct hand_result last;	/* Last measurement */
+};
+
+void tracker_reset(struct tracker *t);
+void tracker_predict(struct tracker *t);
+void tracker_correct(struct tracker *t, const struct hand_result *hand);
+void tracker_result(const struct tracker *t, struct hand_result *hand);
+CvPoint tracker_center(const struct tracker *t);
+
+#endif